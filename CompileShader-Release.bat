@@ -1,3 +1,4 @@
 %VULKAN_SDK%\Bin\glslc.exe -fshader-stage=vert vertex.glsl -o x64\Release\Shaders\vert.spv
 %VULKAN_SDK%\Bin\glslc.exe -fshader-stage=frag fragment.glsl -o x64\Release\Shaders\frag.spv
+%VULKAN_SDK%\Bin\glslc.exe -fshader-stage=comp cull.comp -o x64\Release\Shaders\cull.spv
 @pause
\ No newline at end of file
@@ -1,3 +1,4 @@
 %VULKAN_SDK%\Bin\glslc.exe vertex.vert -o x64\Debug\Shaders\vert.spv
 %VULKAN_SDK%\Bin\glslc.exe fragment.frag -o x64\Debug\Shaders\frag.spv
+%VULKAN_SDK%\Bin\glslc.exe cull.comp -o x64\Debug\Shaders\cull.spv
 @pause
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <exception>
 
+#define VK_CHECK(expr) { if ((expr)) { throw EngineException(__FILE__, __LINE__, #expr); } }
+
 class EngineException : public std::exception
 {
 public:
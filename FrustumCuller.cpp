@@ -0,0 +1,110 @@
+#include "FrustumCuller.h"
+
+#include <cassert>
+#include <cmath>
+#include <xmmintrin.h>
+
+using namespace DirectX;
+
+void FrustumCuller::Resize(uint32_t count)
+{
+	mCount = count;
+
+	size_t paddedCount = (static_cast<size_t>(count) + 3) & ~static_cast<size_t>(3);
+	mCenterX.assign(paddedCount, 0.0f);
+	mCenterY.assign(paddedCount, 0.0f);
+	mCenterZ.assign(paddedCount, 0.0f);
+	mExtentX.assign(paddedCount, 0.0f);
+	mExtentY.assign(paddedCount, 0.0f);
+	mExtentZ.assign(paddedCount, 0.0f);
+}
+
+void FrustumCuller::SetBounds(uint32_t index, const XMFLOAT3& center, const XMFLOAT3& extents, const XMFLOAT4X4& world)
+{
+	assert(index < mCount);
+
+	// Row vectors, so the rows of the world matrix are the images of the local axes.
+	mCenterX[index] = center.x * world._11 + center.y * world._21 + center.z * world._31 + world._41;
+	mCenterY[index] = center.x * world._12 + center.y * world._22 + center.z * world._32 + world._42;
+	mCenterZ[index] = center.x * world._13 + center.y * world._23 + center.z * world._33 + world._43;
+
+	mExtentX[index] = extents.x * fabsf(world._11) + extents.y * fabsf(world._21) + extents.z * fabsf(world._31);
+	mExtentY[index] = extents.x * fabsf(world._12) + extents.y * fabsf(world._22) + extents.z * fabsf(world._32);
+	mExtentZ[index] = extents.x * fabsf(world._13) + extents.y * fabsf(world._23) + extents.z * fabsf(world._33);
+}
+
+uint32_t FrustumCuller::Cull(const XMFLOAT4X4& viewProj, std::vector<uint8_t>& out_visible) const
+{
+	// A point is inside when -w <= x <= w, -w <= y <= w and 0 <= z <= w, with clip = p * viewProj
+	// every plane is a sum of the columns of the matrix. The planes don't need to be normalized
+	// since both the distance and the box radius scale with the length of the normal.
+	const float columns[4][4] =
+	{
+		{ viewProj._11, viewProj._21, viewProj._31, viewProj._41 },
+		{ viewProj._12, viewProj._22, viewProj._32, viewProj._42 },
+		{ viewProj._13, viewProj._23, viewProj._33, viewProj._43 },
+		{ viewProj._14, viewProj._24, viewProj._34, viewProj._44 },
+	};
+
+	float planes[6][4];
+	for (int i = 0; i < 4; i++)
+	{
+		planes[0][i] = columns[3][i] + columns[0][i];
+		planes[1][i] = columns[3][i] - columns[0][i];
+		planes[2][i] = columns[3][i] + columns[1][i];
+		planes[3][i] = columns[3][i] - columns[1][i];
+		planes[4][i] = columns[2][i];
+		planes[5][i] = columns[3][i] - columns[2][i];
+	}
+
+	__m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+	__m128 absPlaneX[6], absPlaneY[6], absPlaneZ[6];
+	for (int p = 0; p < 6; p++)
+	{
+		planeX[p] = _mm_set1_ps(planes[p][0]);
+		planeY[p] = _mm_set1_ps(planes[p][1]);
+		planeZ[p] = _mm_set1_ps(planes[p][2]);
+		planeW[p] = _mm_set1_ps(planes[p][3]);
+		absPlaneX[p] = _mm_set1_ps(fabsf(planes[p][0]));
+		absPlaneY[p] = _mm_set1_ps(fabsf(planes[p][1]));
+		absPlaneZ[p] = _mm_set1_ps(fabsf(planes[p][2]));
+	}
+
+	out_visible.resize(mCount);
+	uint32_t visibleCount = 0;
+	const __m128 zero = _mm_setzero_ps();
+
+	for (uint32_t i = 0; i < mCount; i += 4)
+	{
+		__m128 centerX = _mm_loadu_ps(&mCenterX[i]);
+		__m128 centerY = _mm_loadu_ps(&mCenterY[i]);
+		__m128 centerZ = _mm_loadu_ps(&mCenterZ[i]);
+		__m128 extentX = _mm_loadu_ps(&mExtentX[i]);
+		__m128 extentY = _mm_loadu_ps(&mExtentY[i]);
+		__m128 extentZ = _mm_loadu_ps(&mExtentZ[i]);
+
+		__m128 outside = zero;
+		for (int p = 0; p < 6; p++)
+		{
+			// Signed distance of the box center plus the box radius projected on the plane normal.
+			__m128 distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(planeX[p], centerX), _mm_mul_ps(planeY[p], centerY)),
+				_mm_add_ps(_mm_mul_ps(planeZ[p], centerZ), planeW[p]));
+			__m128 radius = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(absPlaneX[p], extentX), _mm_mul_ps(absPlaneY[p], extentY)),
+				_mm_mul_ps(absPlaneZ[p], extentZ));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+		}
+
+		int outsideMask = _mm_movemask_ps(outside);
+		uint32_t laneCount = mCount - i < 4 ? mCount - i : 4;
+		for (uint32_t lane = 0; lane < laneCount; lane++)
+		{
+			uint8_t visible = (outsideMask & (1 << lane)) ? 0 : 1;
+			out_visible[i + lane] = visible;
+			visibleCount += visible;
+		}
+	}
+
+	return visibleCount;
+}
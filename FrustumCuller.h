@@ -0,0 +1,33 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <vector>
+#include <cstdint>
+
+// Tests world space bounding boxes against the view frustum four boxes at a time with SSE.
+// The boxes are stored as a structure of arrays so a single load gets the same component of
+// four boxes, and every plane test is a handful of multiply adds on whole registers.
+class FrustumCuller
+{
+public:
+	FrustumCuller() = default;
+
+	void Resize(uint32_t count);
+	// Stores the world space box enclosing a local space box transformed by the world matrix.
+	void SetBounds(uint32_t index, const DirectX::XMFLOAT3& center, const DirectX::XMFLOAT3& extents, const DirectX::XMFLOAT4X4& world);
+	// Writes 1 for every box touching the frustum and 0 for culled ones, returns how many are visible.
+	uint32_t Cull(const DirectX::XMFLOAT4X4& viewProj, std::vector<uint8_t>& out_visible) const;
+
+	uint32_t GetCount() const { return mCount; }
+
+private:
+	uint32_t mCount = 0;
+
+	// Padded to a multiple of 4, the padding boxes are tested but never reported.
+	std::vector<float> mCenterX;
+	std::vector<float> mCenterY;
+	std::vector<float> mCenterZ;
+	std::vector<float> mExtentX;
+	std::vector<float> mExtentY;
+	std::vector<float> mExtentZ;
+};
@@ -4,6 +4,7 @@
 
 #include "GeometryGenerator.h"
 #include <algorithm>
+#include <cfloat>
 
 using namespace DirectX;
 
@@ -643,3 +644,33 @@ GeometryGenerator::MeshData GeometryGenerator::CreateQuad(float x, float y, floa
 
 	return meshData;
 }
+
+GeometryGenerator::BoundingVolume GeometryGenerator::ComputeBounds(const std::vector<Vertex>& vertices)
+{
+	XMVECTOR vMin = XMVectorReplicate(FLT_MAX);
+	XMVECTOR vMax = XMVectorReplicate(-FLT_MAX);
+	for (const Vertex& v : vertices)
+	{
+		XMVECTOR p = XMLoadFloat3(&v.Position);
+		vMin = XMVectorMin(vMin, p);
+		vMax = XMVectorMax(vMax, p);
+	}
+
+	XMVECTOR center = XMVectorScale(XMVectorAdd(vMin, vMax), 0.5f);
+	XMVECTOR extents = XMVectorScale(XMVectorSubtract(vMax, vMin), 0.5f);
+
+	float radius = 0.0f;
+	for (const Vertex& v : vertices)
+	{
+		float d = XMVectorGetX(XMVector3Length(XMVectorSubtract(XMLoadFloat3(&v.Position), center)));
+		radius = (std::max)(radius, d);
+	}
+
+	BoundingVolume bounds;
+	XMStoreFloat3(&bounds.Center, center);
+	XMStoreFloat3(&bounds.Extents, extents);
+	XMStoreFloat4(&bounds.Sphere, center);
+	bounds.Sphere.w = radius;
+
+	return bounds;
+}
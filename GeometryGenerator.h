@@ -47,6 +47,15 @@ public:
 		DirectX::XMFLOAT4 Color;
 	};
 
+	struct BoundingVolume
+	{
+		// Axis aligned box as its center and half extents.
+		DirectX::XMFLOAT3 Center;
+		DirectX::XMFLOAT3 Extents;
+		// Sphere around the box center, xyz is the center and w the radius.
+		DirectX::XMFLOAT4 Sphere;
+	};
+
 	struct MeshData
 	{
 		std::vector<Vertex> Vertices;
@@ -103,6 +112,12 @@ public:
 	///</summary>
     MeshData CreateQuad(float x, float y, float w, float h, float depth);
 
+	///<summary>
+	/// Computes the axis aligned bounding box of the vertices and the smallest sphere
+	/// centered on that box that still contains every vertex.
+	///</summary>
+	static BoundingVolume ComputeBounds(const std::vector<Vertex>& vertices);
+
 private:
 	void BuildCylinderTopCap(float bottomRadius, float topRadius, 
 		float height, uint32_t sliceCount, 
@@ -18,6 +18,10 @@ struct VkDeviceInfo
 	VkDevice device;
 	uint32_t graphicsQueueIndex;
 	uint32_t transferQueueIndex;
+	// Optional features, the renderer falls back to slower paths without them.
+	bool multiDrawIndirect;
+	bool drawIndirectFirstInstance;
+	bool drawIndirectCount;
 };
 
 struct Vertex
@@ -26,26 +30,110 @@ struct Vertex
 	DirectX::XMFLOAT4 color;
 };
 
+// A sub-allocation inside one of the MemoryAllocator blocks.
+struct Allocation
+{
+	struct MemoryBlock* block;
+	VkDeviceMemory memory;
+	VkDeviceSize offset;
+	VkDeviceSize size;
+	uint32_t order;
+};
+
 struct Buffer
 {
 	VkBuffer buffer;
-	VkDeviceMemory memory;
+	Allocation allocation;
 	uint32_t size;
 };
 
-struct FrameResources
+// A transfer command buffer and the transfer timeline value its submit signals, once the
+// timeline reaches it the command buffer and its staging region can be reused.
+struct UploadContext
+{
+	VkCommandBuffer CommandBuffer;
+	uint64_t TimelineValue;
+};
+
+// Copies collected by an open upload batch, grouped by destination buffer.
+struct UploadBatch
+{
+	bool open;
+	std::vector<VkBuffer> destinations;
+	std::vector<std::vector<VkBufferCopy>> regions;
+};
+
+// Commands a frame slot recorded against one swapchain image's framebuffer.
+struct ImageCommandBuffers
 {
-	VkSemaphore ImageAcquired;
-	VkSemaphore ImagePresented;
-	VkFence Fence;
-	
 	VkCommandBuffer CommandBuffer;
 	VkCommandPool CommandPool;
-	VkFramebuffer Framebuffer;
+
+	// Set once CommandBuffer holds a recording that may be submitted again, with the visibility it was recorded from.
+	bool Recorded = false;
+	std::vector<uint8_t> RecordedVisibility;
+	// The direct path sorts its draws by view depth, so that recording also depends on the camera.
+	DirectX::XMFLOAT4X4 RecordedView;
+	// What the recording submits, reported again whenever it is reused.
+	uint32_t DrawCallCount = 0;
+	uint32_t AvoidedBindCount = 0;
+
+	// One pool and secondary command buffer per recording thread, a pool must only be used by one thread at a time.
+	std::vector<VkCommandPool> SecondaryCommandPools;
+	std::vector<VkCommandBuffer> SecondaryCommandBuffers;
+};
+
+struct FrameResources
+{
+	// Swapchain acquires can only signal binary semaphores.
+	VkSemaphore ImageAcquired;
+	// Graphics timeline value signaled by this frame's last submit, 0 before the first one.
+	uint64_t TimelineValue = 0;
+
+	// Indexed by swapchain image, the acquired image changes from one use of the slot to the next.
+	std::vector<ImageCommandBuffers> ImageCommands;
 
 	VkDescriptorSet GlobalDescriptorSet;
 	Buffer* ObjectUniformBuffer;
-	std::vector<VkDescriptorSet> ObjectDescriptorSet;
+	// Covers one object slot of the object uniform buffer, the draw picks the slot with a dynamic offset.
+	VkDescriptorSet ObjectDescriptorSet;
+	// Points at this frame's slice of the instance storage buffer.
+	VkDescriptorSet InstanceDescriptorSet;
+	// Inputs and outputs of the culling compute pass for this frame.
+	VkDescriptorSet CullDescriptorSet;
+};
+
+// How the render items are turned into draw calls, switched at runtime with the number keys.
+enum class DrawPath
+{
+	// One draw per render item, where its transform comes from is picked by ObjectDataPath.
+	Direct,
+	// One instanced draw per mesh and submesh, transforms come from the instance buffer.
+	Instanced,
+	// The CPU writes one draw command per render item and a single indirect draw consumes them.
+	Indirect,
+	// A compute pass frustum culls the items and writes the draw commands and their count.
+	GpuCulled
+};
+
+// Where the direct path gets the per object transform from, cycled at runtime with P.
+enum class ObjectDataPath
+{
+	// Every transform of the frame sits in one storage buffer indexed with gl_InstanceIndex,
+	// the descriptor sets are bound once and never per item.
+	StorageBuffer,
+	// The per object uniform set is rebound with a new dynamic offset for every draw.
+	DynamicUniform,
+	// The model-view-projection matrix is pushed for every draw.
+	PushConstant
+};
+
+// Frame pacing measured while one present mode was active, reported when switching away from it.
+struct PresentModeStats
+{
+	double frameTime;
+	double acquireTime;
+	uint32_t frameCount;
 };
 
 struct GlobalUniform 
@@ -70,11 +158,96 @@ struct SingleObjectUniform
 	DirectX::XMFLOAT4X4 model;
 };
 
+// Pushed before every draw of the direct path when push constant transforms are on, mirrors vertex.vert.
+struct ObjectPushConstants
+{
+	DirectX::XMFLOAT4X4 modelViewProj;
+};
+
+// Everything the culling compute shader needs to know about one instance slot, mirrors CullItem in cull.comp.
+struct CullItem
+{
+	DirectX::XMFLOAT4 boundingSphere;
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+	// First command and counter of the indirect draw range the item belongs to.
+	uint32_t firstCommand;
+	uint32_t rangeIndex;
+	uint32_t pad[3];
+};
+
+struct CullParams
+{
+	uint32_t itemCount;
+	uint32_t compact;
+};
+
 struct Image
 {
 	VkImage image;
-	VkDeviceMemory memory;
+	Allocation allocation;
 	VkImageView imageView;
 };
 
+// Everything a swapchain recreate replaced, destroyed once the frames that used it have finished.
+struct RetiredSwapchain
+{
+	VkSwapchainKHR Swapchain;
+	std::vector<VkImageView> ImageViews;
+	std::vector<VkFramebuffer> Framebuffers;
+	std::vector<VkSemaphore> PresentSemaphores;
+	Image DepthBuffer;
+	uint64_t TimelineValue;
+};
+
+// Built by the shader watcher, the render thread swaps it into Target at the start of a frame.
+struct ReloadedPipeline
+{
+	VkPipeline* Target;
+	VkPipeline Pipeline;
+};
+
+// Which vertex buffer layout a pipeline's vertex input is set up for.
+enum class VertexLayout
+{
+	// GeometryGenerator::Vertex as is.
+	Geometry,
+	// PackedVertex, quantized normal, tangent, UV and color.
+	Packed
+};
+
+// Everything a graphics pipeline is built from, the pipeline registry keys its pipelines by a hash of it.
+struct GraphicsPipelineDesc
+{
+	VkShaderModule VertexShader;
+	VkShaderModule FragmentShader;
+	// Specialization constant of the vertex shader.
+	ObjectDataPath ObjectData;
+	// Picks the vertex input attributes.
+	VertexLayout VertexInput;
+	// The line fill variant also sets the fragment shader's specialization constant.
+	VkPolygonMode PolygonMode;
+	VkCullModeFlags CullMode;
+	VkBool32 DepthTest;
+	VkBool32 DepthWrite;
+	VkBool32 BlendEnable;
+	// Pipelines work with any compatible render pass, this one stands in for its compatibility class.
+	VkRenderPass RenderPass;
+	uint32_t Subpass;
+};
+
+// Same as ReloadedPipeline for the registry pipelines, the new desc is picked up by the next lookup.
+struct ReloadedPipelineDesc
+{
+	GraphicsPipelineDesc* Target;
+	GraphicsPipelineDesc Desc;
+};
+
+struct RetiredPipeline
+{
+	VkPipeline Pipeline;
+	uint64_t TimelineValue;
+};
+
 inline constexpr uint64_t CalculateUniformBufferSize(uint64_t bufferSize) { return (bufferSize + 255) & ~255; }
\ No newline at end of file
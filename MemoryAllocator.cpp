@@ -0,0 +1,322 @@
+#include "MemoryAllocator.h"
+
+#include "EngineException.h"
+
+#include <cstdio>
+#include <cassert>
+#include <algorithm>
+
+static VkDeviceSize NextPowerOfTwo(VkDeviceSize value)
+{
+	VkDeviceSize power = 1;
+	while (power < value)
+		power <<= 1;
+	return power;
+}
+
+static uint32_t Log2(VkDeviceSize value)
+{
+	uint32_t log = 0;
+	while (value > 1)
+	{
+		value >>= 1;
+		log++;
+	}
+	return log;
+}
+
+MemoryAllocator::MemoryAllocator(VkDevice device, const VkPhysicalDeviceProperties& properties, const VkPhysicalDeviceMemoryProperties& memoryProperties)
+	:
+	mDevice(device),
+	mMemoryProperties(memoryProperties),
+	mMaxDeviceAllocationCount(properties.limits.maxMemoryAllocationCount)
+{
+}
+
+MemoryAllocator::~MemoryAllocator()
+{
+	for (uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; i++)
+	{
+		for (std::vector<MemoryBlock*>& blocks : mBlocks[i])
+		{
+			for (MemoryBlock* block : blocks)
+			{
+				if (block->allocationCount != 0)
+					printf("MemoryAllocator: block of memory type %u destroyed with %u live allocations\n", i, block->allocationCount);
+				DestroyBlock(block);
+			}
+			blocks.clear();
+		}
+	}
+}
+
+Allocation MemoryAllocator::Allocate(const VkMemoryRequirements& requirements, uint32_t memoryTypeIndex, bool linear)
+{
+	if (memoryTypeIndex >= mMemoryProperties.memoryTypeCount)
+		throw std::exception("Failed to find a suitable memory type for the allocation.");
+
+	// Buddy nodes are aligned to their own size, so asking for a node at least as big as the
+	// alignment is enough to satisfy it.
+	VkDeviceSize nodeSize = requirements.size;
+	if (nodeSize < requirements.alignment)
+		nodeSize = requirements.alignment;
+	if (nodeSize < minNodeSize)
+		nodeSize = minNodeSize;
+	nodeSize = NextPowerOfTwo(nodeSize);
+	uint32_t order = Log2(nodeSize / minNodeSize);
+
+	std::vector<MemoryBlock*>& blocks = mBlocks[memoryTypeIndex][linear ? 0 : 1];
+
+	MemoryBlock* block = nullptr;
+	VkDeviceSize offset = 0;
+	for (MemoryBlock* candidate : blocks)
+	{
+		if (order <= candidate->maxOrder && AllocateNode(candidate, order, offset))
+		{
+			block = candidate;
+			break;
+		}
+	}
+
+	if (!block)
+	{
+		VkDeviceSize blockSize = GetPreferredBlockSize(memoryTypeIndex);
+		if (blockSize < nodeSize)
+			blockSize = nodeSize;
+		block = CreateBlock(memoryTypeIndex, linear, blockSize);
+		blocks.push_back(block);
+		AllocateNode(block, order, offset);
+	}
+
+	block->allocationCount++;
+	block->usedBytes += requirements.size;
+	block->reservedBytes += nodeSize;
+
+	Allocation allocation;
+	allocation.block = block;
+	allocation.memory = block->memory;
+	allocation.offset = offset;
+	allocation.size = requirements.size;
+	allocation.order = order;
+
+	return allocation;
+}
+
+void MemoryAllocator::Free(Allocation& allocation)
+{
+	MemoryBlock* block = allocation.block;
+	if (!block)
+		return;
+
+	FreeNode(block, allocation.offset, allocation.order);
+	block->allocationCount--;
+	block->usedBytes -= allocation.size;
+	block->reservedBytes -= minNodeSize << allocation.order;
+
+	// Keep one empty block around per list so a create/destroy loop doesn't hit the driver every time.
+	if (block->allocationCount == 0 && block->mapCount == 0)
+	{
+		std::vector<MemoryBlock*>& blocks = mBlocks[block->memoryTypeIndex][block->linear ? 0 : 1];
+		for (MemoryBlock* other : blocks)
+		{
+			if (other != block && other->allocationCount == 0)
+			{
+				blocks.erase(std::find(blocks.begin(), blocks.end(), block));
+				DestroyBlock(block);
+				break;
+			}
+		}
+	}
+
+	allocation = {};
+}
+
+void* MemoryAllocator::Map(const Allocation& allocation)
+{
+	MemoryBlock* block = allocation.block;
+	if (block->mapCount++ == 0)
+	{
+		VK_CHECK(vkMapMemory(mDevice, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped));
+	}
+	return static_cast<char*>(block->mapped) + allocation.offset;
+}
+
+void MemoryAllocator::Unmap(const Allocation& allocation)
+{
+	MemoryBlock* block = allocation.block;
+	assert(block->mapCount > 0 && "Unmapping a block that isn't mapped.");
+	if (--block->mapCount == 0)
+	{
+		vkUnmapMemory(mDevice, block->memory);
+		block->mapped = nullptr;
+	}
+}
+
+std::vector<MemoryHeapStats> MemoryAllocator::GetHeapStats() const
+{
+	std::vector<MemoryHeapStats> stats(mMemoryProperties.memoryHeapCount);
+	std::vector<VkDeviceSize> freeBytes(mMemoryProperties.memoryHeapCount);
+
+	for (uint32_t i = 0; i < mMemoryProperties.memoryHeapCount; i++)
+	{
+		stats[i] = {};
+		stats[i].heapIndex = i;
+		stats[i].heapSize = mMemoryProperties.memoryHeaps[i].size;
+	}
+
+	for (uint32_t i = 0; i < mMemoryProperties.memoryTypeCount; i++)
+	{
+		uint32_t heapIndex = mMemoryProperties.memoryTypes[i].heapIndex;
+		MemoryHeapStats& heapStats = stats[heapIndex];
+
+		for (const std::vector<MemoryBlock*>& blocks : mBlocks[i])
+		{
+			for (const MemoryBlock* block : blocks)
+			{
+				heapStats.blockCount++;
+				heapStats.allocationCount += block->allocationCount;
+				heapStats.blockBytes += block->size;
+				heapStats.usedBytes += block->usedBytes;
+				heapStats.reservedBytes += block->reservedBytes;
+				freeBytes[heapIndex] += block->size - block->reservedBytes;
+
+				for (uint32_t order = block->maxOrder + 1; order-- > 0;)
+				{
+					if (!block->freeNodes[order].empty())
+					{
+						VkDeviceSize nodeSize = minNodeSize << order;
+						if (nodeSize > heapStats.largestFreeNode)
+							heapStats.largestFreeNode = nodeSize;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < mMemoryProperties.memoryHeapCount; i++)
+	{
+		if (freeBytes[i] > 0)
+			stats[i].fragmentation = 1.0f - (float)stats[i].largestFreeNode / (float)freeBytes[i];
+	}
+
+	return stats;
+}
+
+void MemoryAllocator::PrintStats() const
+{
+	printf("Device memory allocations: %u / %u\n", mDeviceAllocationCount, mMaxDeviceAllocationCount);
+	for (const MemoryHeapStats& s : GetHeapStats())
+	{
+		if (s.blockCount == 0)
+			continue;
+
+		printf(
+			"\tHeap %u (%llu MB): %u blocks, %u allocations, %.2f / %.2f MB used (%.2f MB reserved), largest free node %.2f MB, fragmentation %.1f%%\n",
+			s.heapIndex,
+			s.heapSize >> 20,
+			s.blockCount,
+			s.allocationCount,
+			s.usedBytes / (1024.0 * 1024.0),
+			s.blockBytes / (1024.0 * 1024.0),
+			s.reservedBytes / (1024.0 * 1024.0),
+			s.largestFreeNode / (1024.0 * 1024.0),
+			s.fragmentation * 100.0f
+		);
+	}
+}
+
+MemoryBlock* MemoryAllocator::CreateBlock(uint32_t memoryTypeIndex, bool linear, VkDeviceSize size)
+{
+	if (mDeviceAllocationCount >= mMaxDeviceAllocationCount)
+		throw std::exception("Reached maxMemoryAllocationCount.");
+
+	VkMemoryAllocateInfo allocateInfo;
+	allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocateInfo.pNext = nullptr;
+	allocateInfo.allocationSize = size;
+	allocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+	VkDeviceMemory memory = nullptr;
+	VK_CHECK(vkAllocateMemory(mDevice, &allocateInfo, nullptr, &memory));
+	mDeviceAllocationCount++;
+
+	MemoryBlock* block = new MemoryBlock();
+	block->memory = memory;
+	block->size = size;
+	block->memoryTypeIndex = memoryTypeIndex;
+	block->linear = linear;
+	block->maxOrder = Log2(size / minNodeSize);
+	block->freeNodes.resize(block->maxOrder + 1);
+	block->freeNodes[block->maxOrder].insert(0);
+	block->allocationCount = 0;
+	block->usedBytes = 0;
+	block->reservedBytes = 0;
+	block->mapped = nullptr;
+	block->mapCount = 0;
+
+	return block;
+}
+
+void MemoryAllocator::DestroyBlock(MemoryBlock* block)
+{
+	if (block->mapCount > 0)
+		vkUnmapMemory(mDevice, block->memory);
+	vkFreeMemory(mDevice, block->memory, nullptr);
+	mDeviceAllocationCount--;
+	delete block;
+}
+
+bool MemoryAllocator::AllocateNode(MemoryBlock* block, uint32_t order, VkDeviceSize& out_offset) const
+{
+	uint32_t current = order;
+	while (current <= block->maxOrder && block->freeNodes[current].empty())
+		current++;
+
+	if (current > block->maxOrder)
+		return false;
+
+	// Lowest offset first keeps the live nodes packed at the start of the block.
+	VkDeviceSize offset = *block->freeNodes[current].begin();
+	block->freeNodes[current].erase(block->freeNodes[current].begin());
+
+	// Split down to the requested order, handing the upper halves back to the free lists.
+	while (current > order)
+	{
+		current--;
+		block->freeNodes[current].insert(offset + (minNodeSize << current));
+	}
+
+	out_offset = offset;
+	return true;
+}
+
+void MemoryAllocator::FreeNode(MemoryBlock* block, VkDeviceSize offset, uint32_t order) const
+{
+	while (order < block->maxOrder)
+	{
+		VkDeviceSize buddy = offset ^ (minNodeSize << order);
+		auto it = block->freeNodes[order].find(buddy);
+		if (it == block->freeNodes[order].end())
+			break;
+
+		block->freeNodes[order].erase(it);
+		if (buddy < offset)
+			offset = buddy;
+		order++;
+	}
+	block->freeNodes[order].insert(offset);
+}
+
+VkDeviceSize MemoryAllocator::GetPreferredBlockSize(uint32_t memoryTypeIndex) const
+{
+	// Small heaps (like the 256 MB BAR heap) get smaller blocks so one block doesn't eat most of it.
+	uint32_t heapIndex = mMemoryProperties.memoryTypes[memoryTypeIndex].heapIndex;
+	VkDeviceSize heapSize = mMemoryProperties.memoryHeaps[heapIndex].size;
+
+	VkDeviceSize blockSize = defaultBlockSize;
+	while (blockSize > minNodeSize && blockSize > heapSize / 8)
+		blockSize >>= 1;
+
+	return blockSize;
+}
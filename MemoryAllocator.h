@@ -0,0 +1,81 @@
+#pragma once
+
+#include "HelperStructs.h"
+#include <vector>
+#include <set>
+
+// A buddy allocator that carves big VkDeviceMemory blocks into power of two nodes.
+// Every memory type has two block lists, one for linear resources (buffers) and one for
+// optimal tiled images, so we never have to care about bufferImageGranularity.
+struct MemoryBlock
+{
+	VkDeviceMemory memory;
+	VkDeviceSize size;
+	uint32_t memoryTypeIndex;
+	bool linear;
+	uint32_t maxOrder;
+	// One set of free node offsets per order, a node of order n is (minNodeSize << n) bytes.
+	std::vector<std::set<VkDeviceSize>> freeNodes;
+	uint32_t allocationCount;
+	VkDeviceSize usedBytes;
+	VkDeviceSize reservedBytes;
+	void* mapped;
+	uint32_t mapCount;
+};
+
+struct MemoryHeapStats
+{
+	uint32_t heapIndex;
+	VkDeviceSize heapSize;
+	uint32_t blockCount;
+	uint32_t allocationCount;
+	// Bytes we got from vkAllocateMemory.
+	VkDeviceSize blockBytes;
+	// Bytes the resources actually asked for.
+	VkDeviceSize usedBytes;
+	// Bytes taken by buddy nodes, the difference to usedBytes is internal fragmentation.
+	VkDeviceSize reservedBytes;
+	VkDeviceSize largestFreeNode;
+	// 0 means all the free memory is in one node, close to 1 means it is scattered in tiny nodes.
+	float fragmentation;
+};
+
+class MemoryAllocator
+{
+public:
+	MemoryAllocator(VkDevice device, const VkPhysicalDeviceProperties& properties, const VkPhysicalDeviceMemoryProperties& memoryProperties);
+	~MemoryAllocator();
+
+	MemoryAllocator(const MemoryAllocator&) = delete;
+	MemoryAllocator& operator=(const MemoryAllocator&) = delete;
+
+	Allocation Allocate(const VkMemoryRequirements& requirements, uint32_t memoryTypeIndex, bool linear);
+	void Free(Allocation& allocation);
+
+	// Mapping is reference counted per block since a VkDeviceMemory can only be mapped once.
+	void* Map(const Allocation& allocation);
+	void Unmap(const Allocation& allocation);
+
+	std::vector<MemoryHeapStats> GetHeapStats() const;
+	void PrintStats() const;
+	uint32_t GetDeviceAllocationCount() const { return mDeviceAllocationCount; }
+
+private:
+	MemoryBlock* CreateBlock(uint32_t memoryTypeIndex, bool linear, VkDeviceSize size);
+	void DestroyBlock(MemoryBlock* block);
+	bool AllocateNode(MemoryBlock* block, uint32_t order, VkDeviceSize& out_offset) const;
+	void FreeNode(MemoryBlock* block, VkDeviceSize offset, uint32_t order) const;
+	VkDeviceSize GetPreferredBlockSize(uint32_t memoryTypeIndex) const;
+
+private:
+	static constexpr VkDeviceSize minNodeSize = 256;
+	static constexpr VkDeviceSize defaultBlockSize = 64ull * 1024 * 1024;
+
+	VkDevice mDevice;
+	VkPhysicalDeviceMemoryProperties mMemoryProperties;
+	uint32_t mMaxDeviceAllocationCount;
+	uint32_t mDeviceAllocationCount = 0;
+
+	// [memoryTypeIndex][0 = linear, 1 = optimal]
+	std::vector<MemoryBlock*> mBlocks[VK_MAX_MEMORY_TYPES][2];
+};
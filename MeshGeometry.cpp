@@ -1 +1,66 @@
 #include "MeshGeometry.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace DirectX;
+
+static int16_t PackSnorm16(float value)
+{
+	return static_cast<int16_t>(std::round(std::clamp(value, -1.0f, 1.0f) * 32767.0f));
+}
+
+static uint32_t PackUnorm8(float value)
+{
+	return static_cast<uint32_t>(std::round(std::clamp(value, 0.0f, 1.0f) * 255.0f));
+}
+
+// Projects the unit vector onto the octahedron |x| + |y| + |z| = 1 and folds the lower half over the upper one,
+// two components are left that the shader turns back into the vector.
+static void PackOctahedral(const XMFLOAT3& vector, int16_t out_packed[2])
+{
+	float length = std::fabs(vector.x) + std::fabs(vector.y) + std::fabs(vector.z);
+	if (length == 0.0f)
+	{
+		out_packed[0] = 0;
+		out_packed[1] = 0;
+		return;
+	}
+
+	float x = vector.x / length;
+	float y = vector.y / length;
+	if (vector.z < 0.0f)
+	{
+		float foldedX = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float foldedY = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = foldedX;
+		y = foldedY;
+	}
+
+	out_packed[0] = PackSnorm16(x);
+	out_packed[1] = PackSnorm16(y);
+}
+
+std::vector<PackedVertex> PackVertices(const std::vector<GeometryGenerator::Vertex>& vertices)
+{
+	std::vector<PackedVertex> packedVertices(vertices.size());
+
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		const GeometryGenerator::Vertex& vertex = vertices[i];
+		PackedVertex& packed = packedVertices[i];
+
+		// Kept at full precision, the terrain spans 160 units and half floats would visibly step.
+		packed.Position = vertex.Position;
+		PackOctahedral(vertex.Normal, packed.Normal);
+		PackOctahedral(vertex.TangentU, packed.TangentU);
+		packed.TexC[0] = PackedVector::XMConvertFloatToHalf(vertex.TexC.x);
+		packed.TexC[1] = PackedVector::XMConvertFloatToHalf(vertex.TexC.y);
+		packed.Color = PackUnorm8(vertex.Color.x) |
+			(PackUnorm8(vertex.Color.y) << 8) |
+			(PackUnorm8(vertex.Color.z) << 16) |
+			(PackUnorm8(vertex.Color.w) << 24);
+	}
+
+	return packedVertices;
+}
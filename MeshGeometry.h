@@ -1,6 +1,8 @@
 #pragma once
 
 #include "HelperStructs.h"
+#include "GeometryGenerator.h"
+#include <DirectXPackedVector.h>
 #include <unordered_map>
 
 struct SubmeshGeometry
@@ -8,6 +10,9 @@ struct SubmeshGeometry
 	uint32_t indexCount;
 	uint32_t firstIndex;
 	uint32_t vertexOffset;
+
+	// Bounds of the submesh in its own space.
+	GeometryGenerator::BoundingVolume Bounds;
 };
 
 struct MeshGeometry
@@ -17,3 +22,19 @@ struct MeshGeometry
 	Buffer VertexBuffer;
 	Buffer IndexBuffer;
 };
+
+// What the meshes are uploaded as with VertexLayout::Packed, 28 bytes instead of the 60 of GeometryGenerator::Vertex.
+// Normal and tangent are octahedral encoded into two snorm16 each, the UV is two halfs and the color RGBA8.
+struct PackedVertex
+{
+	DirectX::XMFLOAT3 Position;
+	int16_t Normal[2];
+	int16_t TangentU[2];
+	DirectX::PackedVector::HALF TexC[2];
+	uint32_t Color;
+};
+
+static_assert(sizeof(PackedVertex) == 28, "PackedVertex must match the packed vertex input of the pipelines.");
+
+// The conversion pass every mesh goes through before its vertices are uploaded.
+std::vector<PackedVertex> PackVertices(const std::vector<GeometryGenerator::Vertex>& vertices);
@@ -0,0 +1,103 @@
+#include "PipelineCache.h"
+
+#include "EngineException.h"
+
+#include <Windows.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+void PipelineCache::Init(VkDevice device, const VkPhysicalDeviceProperties& properties, const char* path)
+{
+	mDevice = device;
+	mPath = path;
+	mLoadedBytes = 0;
+
+	std::vector<char> data;
+	std::ifstream file(mPath, std::ios::binary | std::ios::ate);
+	if (file.is_open())
+	{
+		data.resize(static_cast<size_t>(file.tellg()));
+		file.seekg(0);
+		file.read(data.data(), data.size());
+		if (!file)
+			data.clear();
+	}
+
+	if (!data.empty() && !IsHeaderValid(data, properties))
+	{
+		std::cout << "Pipeline cache " << mPath << " was written by another driver or device, starting from scratch.\n";
+		data.clear();
+	}
+
+	VkPipelineCacheCreateInfo createInfo;
+	createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	createInfo.pNext = nullptr;
+	createInfo.flags = 0;
+	createInfo.initialDataSize = data.size();
+	createInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+	VK_CHECK(vkCreatePipelineCache(mDevice, &createInfo, nullptr, &mCache));
+	mLoadedBytes = data.size();
+}
+
+void PipelineCache::Save() const
+{
+	size_t size = 0;
+	VK_CHECK(vkGetPipelineCacheData(mDevice, mCache, &size, nullptr));
+
+	std::vector<char> data(size);
+	VK_CHECK(vkGetPipelineCacheData(mDevice, mCache, &size, data.data()));
+
+	std::string tempPath = mPath + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		file.write(data.data(), size);
+		if (!file)
+		{
+			std::cout << "Failed to write the pipeline cache to " << tempPath << "\n";
+			return;
+		}
+	}
+
+	if (!MoveFileExA(tempPath.c_str(), mPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		std::cout << "Failed to replace the pipeline cache " << mPath << "\n";
+		DeleteFileA(tempPath.c_str());
+	}
+}
+
+void PipelineCache::Release()
+{
+	if (mCache)
+	{
+		vkDestroyPipelineCache(mDevice, mCache, nullptr);
+		mCache = nullptr;
+	}
+}
+
+bool PipelineCache::IsHeaderValid(const std::vector<char>& data, const VkPhysicalDeviceProperties& properties) const
+{
+	// Laid out as VkPipelineCacheHeaderVersionOne, read field by field so padding can't get in the way.
+	uint32_t headerSize = 0;
+	uint32_t headerVersion = 0;
+	uint32_t vendorID = 0;
+	uint32_t deviceID = 0;
+	uint8_t uuid[VK_UUID_SIZE];
+
+	if (data.size() < 16 + VK_UUID_SIZE)
+		return false;
+
+	memcpy(&headerSize, data.data(), 4);
+	memcpy(&headerVersion, data.data() + 4, 4);
+	memcpy(&vendorID, data.data() + 8, 4);
+	memcpy(&deviceID, data.data() + 12, 4);
+	memcpy(uuid, data.data() + 16, VK_UUID_SIZE);
+
+	return headerSize >= 16 + VK_UUID_SIZE &&
+		headerSize <= data.size() &&
+		headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+		vendorID == properties.vendorID &&
+		deviceID == properties.deviceID &&
+		memcmp(uuid, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
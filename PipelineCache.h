@@ -0,0 +1,30 @@
+#pragma once
+
+#include "HelperStructs.h"
+#include <string>
+
+// A VkPipelineCache that lives in a file between runs. The file is only used when its header
+// was written by the same driver and device, anything else starts from an empty cache.
+class PipelineCache
+{
+public:
+	PipelineCache() = default;
+
+	void Init(VkDevice device, const VkPhysicalDeviceProperties& properties, const char* path);
+	// Writes the cache next to the old file first and then swaps them, so a crash never leaves a torn file behind.
+	void Save() const;
+	void Release();
+
+	VkPipelineCache GetHandle() const { return mCache; }
+	// True when the file was accepted, the pipelines created from it should mostly be cache hits.
+	bool IsWarm() const { return mLoadedBytes > 0; }
+	size_t GetLoadedBytes() const { return mLoadedBytes; }
+
+private:
+	bool IsHeaderValid(const std::vector<char>& data, const VkPhysicalDeviceProperties& properties) const;
+
+	VkDevice mDevice = nullptr;
+	VkPipelineCache mCache = nullptr;
+	std::string mPath;
+	size_t mLoadedBytes = 0;
+};
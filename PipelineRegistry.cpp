@@ -0,0 +1,177 @@
+#include "PipelineRegistry.h"
+
+#include "Timer.h"
+
+#include <cstdio>
+
+PipelineRegistry::~PipelineRegistry()
+{
+	Release();
+}
+
+void PipelineRegistry::Init(VkDevice device, BuildFunction build)
+{
+	mDevice = device;
+	mBuild = std::move(build);
+	mQuit = false;
+	mThread = std::thread(&PipelineRegistry::CompileMain, this);
+}
+
+void PipelineRegistry::Release()
+{
+	if (mThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mQuit = true;
+		}
+		mQueueCondition.notify_all();
+		mThread.join();
+	}
+
+	for (auto& entry : mEntries)
+	{
+		if (entry.second.pipeline)
+			vkDestroyPipeline(mDevice, entry.second.pipeline, nullptr);
+	}
+	mEntries.clear();
+	mQueue.clear();
+}
+
+VkPipeline PipelineRegistry::GetBlocking(const GraphicsPipelineDesc& desc)
+{
+	uint64_t hash = Hash(desc);
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mEntries.find(hash);
+		if (it != mEntries.end() && it->second.state == EntryState::Ready)
+			return it->second.pipeline;
+	}
+
+	// Building outside the lock lets the compile thread keep going. If it was already queued the
+	// compile thread may build it too, the loser of that race is thrown away below.
+	VkPipeline pipeline = mBuild(desc);
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	Entry& entry = mEntries[hash];
+	if (entry.pipeline)
+	{
+		vkDestroyPipeline(mDevice, pipeline, nullptr);
+		return entry.pipeline;
+	}
+
+	entry.desc = desc;
+	entry.pipeline = pipeline;
+	entry.state = EntryState::Ready;
+	return pipeline;
+}
+
+VkPipeline PipelineRegistry::Get(const GraphicsPipelineDesc& desc, VkPipeline fallback)
+{
+	uint64_t hash = Hash(desc);
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	Entry& entry = FindOrQueue(hash, desc);
+	return entry.state == EntryState::Ready ? entry.pipeline : fallback;
+}
+
+void PipelineRegistry::Request(const GraphicsPipelineDesc& desc)
+{
+	uint64_t hash = Hash(desc);
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	FindOrQueue(hash, desc);
+}
+
+uint64_t PipelineRegistry::Hash(const GraphicsPipelineDesc& desc)
+{
+	// FNV-1a over every field on its own, so padding inside the desc never reaches the hash.
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&hash](uint64_t value)
+	{
+		for (int i = 0; i < 8; i++)
+		{
+			hash ^= (value >> (i * 8)) & 0xff;
+			hash *= 1099511628211ull;
+		}
+	};
+
+	mix(reinterpret_cast<uint64_t>(desc.VertexShader));
+	mix(reinterpret_cast<uint64_t>(desc.FragmentShader));
+	mix(static_cast<uint64_t>(desc.ObjectData));
+	mix(static_cast<uint64_t>(desc.VertexInput));
+	mix(desc.PolygonMode);
+	mix(desc.CullMode);
+	mix(desc.DepthTest);
+	mix(desc.DepthWrite);
+	mix(desc.BlendEnable);
+	mix(reinterpret_cast<uint64_t>(desc.RenderPass));
+	mix(desc.Subpass);
+
+	return hash;
+}
+
+PipelineRegistry::Entry& PipelineRegistry::FindOrQueue(uint64_t hash, const GraphicsPipelineDesc& desc)
+{
+	auto it = mEntries.find(hash);
+	if (it != mEntries.end())
+		return it->second;
+
+	Entry& entry = mEntries[hash];
+	entry.desc = desc;
+	entry.pipeline = nullptr;
+	entry.state = EntryState::Queued;
+	mQueue.push_back(hash);
+	mQueueCondition.notify_one();
+
+	return entry;
+}
+
+void PipelineRegistry::CompileMain()
+{
+	for (;;)
+	{
+		uint64_t hash = 0;
+		GraphicsPipelineDesc desc;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mQueueCondition.wait(lock, [this] { return mQuit || !mQueue.empty(); });
+			if (mQuit)
+				return;
+
+			hash = mQueue.front();
+			mQueue.pop_front();
+			// GetBlocking may have beaten us to it.
+			if (mEntries[hash].state != EntryState::Queued)
+				continue;
+			desc = mEntries[hash].desc;
+		}
+
+		Timer compileTimer;
+		compileTimer.MarkTime();
+		VkPipeline pipeline = nullptr;
+		try
+		{
+			pipeline = mBuild(desc);
+		}
+		catch (const std::exception& e)
+		{
+			printf("Pipeline %016llx failed to build, keeping its fallback: %s\n", (unsigned long long)hash, e.what());
+		}
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		Entry& entry = mEntries[hash];
+		if (entry.pipeline)
+		{
+			if (pipeline)
+				vkDestroyPipeline(mDevice, pipeline, nullptr);
+		}
+		else
+		{
+			entry.pipeline = pipeline;
+			entry.state = pipeline ? EntryState::Ready : EntryState::Failed;
+			if (pipeline)
+				printf("Pipeline %016llx compiled in %.2f ms\n", (unsigned long long)hash, compileTimer.PeekTime() * 1000.0);
+		}
+	}
+}
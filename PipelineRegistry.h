@@ -0,0 +1,63 @@
+#pragma once
+
+#include "HelperStructs.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Owns every graphics pipeline, keyed by a hash of the GraphicsPipelineDesc it was built from.
+// Pipelines that aren't built yet are compiled on a background thread and callers draw with a
+// fallback in the meantime, so a new variant never stalls the frame that first asks for it.
+class PipelineRegistry
+{
+public:
+	// Called on the compile thread as well as the caller's, it must only read state that doesn't change.
+	using BuildFunction = std::function<VkPipeline(const GraphicsPipelineDesc&)>;
+
+	PipelineRegistry() = default;
+	~PipelineRegistry();
+
+	PipelineRegistry(const PipelineRegistry&) = delete;
+	PipelineRegistry& operator=(const PipelineRegistry&) = delete;
+
+	void Init(VkDevice device, BuildFunction build);
+	// Stops the compile thread and destroys every pipeline, the GPU must be done with them.
+	void Release();
+
+	// Builds the pipeline right here when it doesn't exist yet, for startup where there is nothing to fall back to.
+	VkPipeline GetBlocking(const GraphicsPipelineDesc& desc);
+	// Returns fallback until the compile thread has built the pipeline, or forever if building it failed.
+	VkPipeline Get(const GraphicsPipelineDesc& desc, VkPipeline fallback);
+	// Queues the pipeline without waiting for it, to have variants ready before they are first drawn.
+	void Request(const GraphicsPipelineDesc& desc);
+
+	static uint64_t Hash(const GraphicsPipelineDesc& desc);
+
+private:
+	enum class EntryState { Queued, Ready, Failed };
+
+	struct Entry
+	{
+		GraphicsPipelineDesc desc;
+		VkPipeline pipeline;
+		EntryState state;
+	};
+
+	// Returns the entry for the hash, adding and queueing it when it's new. Needs mMutex.
+	Entry& FindOrQueue(uint64_t hash, const GraphicsPipelineDesc& desc);
+	void CompileMain();
+
+	VkDevice mDevice = nullptr;
+	BuildFunction mBuild;
+
+	std::unordered_map<uint64_t, Entry> mEntries;
+	std::deque<uint64_t> mQueue;
+
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mQueueCondition;
+	bool mQuit = false;
+};
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 #include "HelperStructs.h"
+#include "GeometryGenerator.h"
 
 struct RenderItem
 {
@@ -18,5 +20,36 @@ struct RenderItem
 	uint32_t indexCount;
 	uint32_t firstIndex;
 	uint32_t vertexOffset;
+
+	// Copied from the submesh, in the item's local space.
+	GeometryGenerator::BoundingVolume Bounds;
+
+	// Filled by Renderer::BuildInstanceBatches, used to build the item's sort key.
+	uint32_t meshId;
+	uint32_t instanceBatch;
+};
+
+// Render items that share the same mesh and submesh, drawn with a single instanced draw.
+struct InstanceBatch
+{
+	struct MeshGeometry* MeshGeo;
+
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	uint32_t vertexOffset;
+	GeometryGenerator::BoundingVolume Bounds;
+
+	// Where the batch starts in the instance buffer, its transforms are stored back to back.
+	uint32_t firstInstance;
+	std::vector<uint32_t> renderItems;
+};
+
+// Consecutive instance batches that share vertex and index buffers, consumed by one indirect draw.
+struct IndirectDrawRange
+{
+	struct MeshGeometry* MeshGeo;
+
+	uint32_t firstCommand;
+	uint32_t commandCount;
 };
 
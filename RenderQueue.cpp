@@ -0,0 +1,68 @@
+#include "RenderQueue.h"
+
+#include <cassert>
+#include <cstring>
+
+uint64_t RenderQueue::MakeSortKey(uint32_t pipelineId, uint32_t meshId, uint32_t descriptorId, float depth)
+{
+	assert(pipelineId < (1u << 8) && meshId < (1u << 12) && descriptorId < (1u << 12));
+
+	// Anything behind the eye is clamped to 0 so the sign bit never flips the order.
+	if (!(depth > 0.0f))
+		depth = 0.0f;
+	uint32_t depthBits;
+	memcpy(&depthBits, &depth, sizeof(depthBits));
+
+	return (static_cast<uint64_t>(pipelineId) << 56) |
+		(static_cast<uint64_t>(meshId) << 44) |
+		(static_cast<uint64_t>(descriptorId) << 32) |
+		depthBits;
+}
+
+void RenderQueue::Clear()
+{
+	mKeys.clear();
+	mItems.clear();
+}
+
+void RenderQueue::Push(uint64_t sortKey, uint32_t itemIndex)
+{
+	mKeys.push_back(sortKey);
+	mItems.push_back(itemIndex);
+}
+
+void RenderQueue::Sort()
+{
+	size_t count = mKeys.size();
+	mScratchKeys.resize(count);
+	mScratchItems.resize(count);
+
+	for (uint32_t shift = 0; shift < 64; shift += 8)
+	{
+		uint32_t histogram[256] = {};
+		for (size_t i = 0; i < count; i++)
+			histogram[(mKeys[i] >> shift) & 0xFF]++;
+
+		// Every key falls in the same bucket, this pass wouldn't move anything.
+		if (count == 0 || histogram[(mKeys[0] >> shift) & 0xFF] == count)
+			continue;
+
+		uint32_t offset = 0;
+		for (uint32_t bucket = 0; bucket < 256; bucket++)
+		{
+			uint32_t bucketCount = histogram[bucket];
+			histogram[bucket] = offset;
+			offset += bucketCount;
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			uint32_t destination = histogram[(mKeys[i] >> shift) & 0xFF]++;
+			mScratchKeys[destination] = mKeys[i];
+			mScratchItems[destination] = mItems[i];
+		}
+
+		mKeys.swap(mScratchKeys);
+		mItems.swap(mScratchItems);
+	}
+}
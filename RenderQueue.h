@@ -0,0 +1,36 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+// Draws of one frame as 64 bit sort keys paired with the index of their render item.
+// The key puts the most expensive state change in the highest bits so that after sorting
+// draws sharing a pipeline, then a mesh, then a descriptor group end up next to each other,
+// and inside a group they go front to back:
+//
+//   63      56 55        44 43        32 31                0
+//   | pipeline |    mesh    | descriptor |   view depth    |
+class RenderQueue
+{
+public:
+	RenderQueue() = default;
+
+	// depth must be positive, the bits of a positive float sort like the float itself.
+	static uint64_t MakeSortKey(uint32_t pipelineId, uint32_t meshId, uint32_t descriptorId, float depth);
+
+	void Clear();
+	void Push(uint64_t sortKey, uint32_t itemIndex);
+	// Least significant digit radix sort, 8 bits per pass. Passes where every key has the
+	// same digit are skipped, with few pipelines and meshes most of the high passes are.
+	void Sort();
+
+	size_t GetSize() const { return mKeys.size(); }
+	uint32_t GetItem(size_t index) const { return mItems[index]; }
+
+private:
+	std::vector<uint64_t> mKeys;
+	std::vector<uint32_t> mItems;
+	// Ping pong buffers for the sort passes.
+	std::vector<uint64_t> mScratchKeys;
+	std::vector<uint32_t> mScratchItems;
+};
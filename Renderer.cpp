@@ -8,6 +8,8 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <cstring>
 
 using namespace DirectX;
 
@@ -21,6 +23,30 @@ using namespace DirectX;
 
 static char* msgBuf;
 
+// The GLSL sources hot reload watches and the SPIR-V the pipelines load, as in CompileShader.bat.
+// The executable runs from x64\<configuration>, two levels below the sources.
+static const struct
+{
+	const char* sourcePath;
+	const char* spirvPath;
+} watchedShaders[] = {
+	{ "../../vertex.vert", "./Shaders/vert.spv" },
+	{ "../../fragment.frag", "./Shaders/frag.spv" },
+	{ "../../cull.comp", "./Shaders/cull.spv" },
+};
+
+static const char* GetPresentModeName(VkPresentModeKHR presentMode)
+{
+	switch (presentMode)
+	{
+	case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+	case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+	case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+	case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+	default: return "UNKNOWN";
+	}
+}
+
 VkBool32 __stdcall vkDebugUtilsMessengerCallback (
 	VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
 	VkDebugUtilsMessageTypeFlagsEXT messageTypes,
@@ -45,119 +71,186 @@ Renderer::Renderer(const Window* window)
 	mDeviceInfo = CreateLogicalDevice();
 	mDevice = mDeviceInfo.device;
 	mGraphicsQueueIndex = mDeviceInfo.graphicsQueueIndex;
+	mAllocator = new MemoryAllocator(mDevice, mPhysicalDevice.properties, mPhysicalDevice.memoryProperties);
 	vkGetDeviceQueue(mDevice, mDeviceInfo.graphicsQueueIndex, 0, &mGraphicsQueue);
 	vkGetDeviceQueue(mDevice, mDeviceInfo.transferQueueIndex, 0, &mTransferQueue);
 	mMainCmdPool = CreateCommandPool(mDeviceInfo.graphicsQueueIndex);
 	mMainCmd = AllocateCommandBuffer(mMainCmdPool);
 	mMainTransferCmdPool = CreateCommandPool(mDeviceInfo.transferQueueIndex);
-	mMainTransferCmd = AllocateCommandBuffer(mMainTransferCmdPool);
+	mTransferTimeline = CreateTimelineSemaphore(0);
+	mGraphicsTimeline = CreateTimelineSemaphore(0);
+	mStagingBuffer = CreateUploadBuffer(stagingBufferSize);
+	BindBuffer(mStagingBuffer);
+	mStagingRing.Init(mAllocator, mStagingBuffer, stagingBufferSize);
 	mSurface = CreateVulkanSurface();
-	mSwapchain = CreateSwapchain(mSwapchainSurfaceFormat);
+	mSupportedPresentModes = GetSupportedPresentModes();
+	mSwapchain = CreateSwapchain(mSwapchainSurfaceFormat, mSwapchainExtent);
 	mImageCount = GetSwapchainImagesCount();
 	mImages = GetSwapchainImages(mImageCount);
 	mDepthBuffer = CreateDepthBuffer();
 	mRenderpass = CreateRenderPass();
 
-	for (VkImage image : mImages)
+	uint32_t recordThreadCount = std::max(1u, std::min(std::thread::hardware_concurrency(), maxRecordThreads));
+	mRecordThreads = new ThreadPool(recordThreadCount);
+	printf("Recording threads: %u\n", recordThreadCount);
+
+	CreateSwapchainImageResources();
+
+	for (uint32_t i = 0; i < framesInFlight; i++)
 	{
-		VkImageView imgView = CreateImageView(mSwapchainSurfaceFormat.format, image, VK_IMAGE_ASPECT_COLOR_BIT);
-		mImageViews.push_back(imgView);
-		
 		FrameResources frameRes;
 		frameRes.ImageAcquired = CreateSemaphore();
-		frameRes.ImagePresented = CreateSemaphore();
-		frameRes.Fence = CreateVulkanFence();
-		frameRes.CommandPool = CreateCommandPool(mDeviceInfo.graphicsQueueIndex);
-		frameRes.CommandBuffer = AllocateCommandBuffer(frameRes.CommandPool);
-		VkImageView imgViews[] = { imgView, mDepthBuffer.imageView };
-		frameRes.Framebuffer = CreateFramebuffer(mRenderpass, 2, imgViews, mWindow->GetWindowWidth(), mWindow->GetWindowHeight());
+		CreateImageCommandBuffers(frameRes);
 		mFrameResources.push_back(frameRes);
 	}
+	printf("Frames in flight: %u, swapchain images: %u\n", framesInFlight, mImageCount);
 
-	VkSurfaceCapabilitiesKHR surfaceCapabilities;
-	VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(
-		mPhysicalDevice.physicalDevice,
-		mSurface,
-		&surfaceCapabilities
-	));
-
-	mViewport.minDepth = 0.0f;
-	mViewport.maxDepth = 1.0f;
-	mViewport.width = static_cast<float>(surfaceCapabilities.currentExtent.width);
-	mViewport.height = -static_cast<float>(surfaceCapabilities.currentExtent.height);
-	mViewport.x = 0.0f;
-	mViewport.y = static_cast<float>(surfaceCapabilities.currentExtent.height);
-
-	mScissor.extent = surfaceCapabilities.currentExtent;
-	mScissor.offset = { 0, 0 };
+	UpdateViewportAndScissor();
 
-	mGlobalDescriptorSetLayout = CreateDescriptorSetLayout();
+	mGlobalDescriptorSetLayout = CreateDescriptorSetLayout(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+	mObjectDescriptorSetLayout = CreateDescriptorSetLayout(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+	mInstanceDescriptorSetLayout = CreateDescriptorSetLayout(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	mCullDescriptorSetLayout = CreateCullDescriptorSetLayout();
 	mGlobalDescriptorPool = CreateDescriptorPool();
 	std::vector<VkDescriptorSet> descriptorSets = AllocateGlobalDescriptorSets();
 
 	/* Start uniform buffer */
-	mGlobalUniformBuffer = CreateGlobalUniformBuffer(mImageCount);
+	mGlobalUniformBuffer = CreateGlobalUniformBuffer(framesInFlight);
 	BindBuffer(mGlobalUniformBuffer);
+	mGlobalUniformRing.Init(mAllocator, mGlobalUniformBuffer, CalculateUniformBufferSize(sizeof(GlobalUniform)), framesInFlight);
 
 	mMeshGeometry = BuildLandGeometry();
 
 	BuildLandRenderItems();
+	BuildInstanceBatches();
+	mFrustumCuller.Resize(static_cast<uint32_t>(mRenderItems.size()));
 
 	uint64_t renderItemCount = mRenderItems.size();
 
-	mObjectUniformBuffer = CreateUniformBuffer((renderItemCount * mImageCount) * CalculateUniformBufferSize(sizeof(SingleObjectUniform)));
+	mObjectUniformBuffer = CreateUniformBuffer((renderItemCount * framesInFlight) * CalculateUniformBufferSize(sizeof(SingleObjectUniform)));
 
 	BindBuffer(mObjectUniformBuffer);
+	mObjectUniformRing.Init(mAllocator, mObjectUniformBuffer, renderItemCount * CalculateUniformBufferSize(sizeof(SingleObjectUniform)), framesInFlight);
+
+	// Instance transforms are tightly packed, one slice per frame.
+	VkDeviceSize instanceFrameSize = CalculateUniformBufferSize(renderItemCount * sizeof(SingleObjectUniform));
+	mInstanceBuffer = CreateUniformBuffer(instanceFrameSize * framesInFlight, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	BindBuffer(mInstanceBuffer);
+	mInstanceRing.Init(mAllocator, mInstanceBuffer, instanceFrameSize, framesInFlight);
+
+	// Storage usage so a compute pass can write the draw commands instead of the CPU.
+	VkDeviceSize indirectFrameSize = CalculateUniformBufferSize(renderItemCount * sizeof(VkDrawIndexedIndirectCommand));
+	mIndirectBuffer = CreateUniformBuffer(indirectFrameSize * framesInFlight, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+	BindBuffer(mIndirectBuffer);
+	mIndirectRing.Init(mAllocator, mIndirectBuffer, indirectFrameSize, framesInFlight);
+
+	CreateCullResources();
 
 	for (size_t i = 0; i < mFrameResources.size(); i++) {
 		mFrameResources[i].GlobalDescriptorSet = descriptorSets[i];
 		UpdateDescriptorSet(mGlobalUniformBuffer, sizeof(GlobalUniform), descriptorSets[i], i, 0);
 		mFrameResources[i].ObjectUniformBuffer = &mObjectUniformBuffer;
-		for (uint64_t j = 0; j < renderItemCount; j++) {
-			VkDescriptorSet descriptorSet = CreateDescriptorSet();
-			mFrameResources[i].ObjectDescriptorSet.push_back(descriptorSet);
-			UpdateDescriptorSet(mObjectUniformBuffer, CalculateUniformBufferSize(sizeof(SingleObjectUniform)), descriptorSet, i * renderItemCount + j, 0);
-		}
+		mFrameResources[i].ObjectDescriptorSet = CreateDescriptorSet(mObjectDescriptorSetLayout);
+		UpdateDescriptorSet(mObjectUniformBuffer, sizeof(SingleObjectUniform), mFrameResources[i].ObjectDescriptorSet, 0, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+		mFrameResources[i].InstanceDescriptorSet = CreateDescriptorSet(mInstanceDescriptorSetLayout);
+		UpdateStorageDescriptorSet(mInstanceBuffer, mFrameResources[i].InstanceDescriptorSet, mInstanceRing.GetFrameOffset((uint32_t)i), mInstanceRing.GetFrameSize(), 0);
+		mFrameResources[i].CullDescriptorSet = CreateDescriptorSet(mCullDescriptorSetLayout);
+		UpdateCullDescriptorSet((uint32_t)i);
 	}
 	
 	/* End uniform buffer */
 
+	// Every pipeline below goes through the cache, on a warm start most of the compilation is skipped.
+	Timer pipelineTimer;
+	pipelineTimer.MarkTime();
+	mPipelineCache.Init(mDevice, mPhysicalDevice.properties, pipelineCachePath);
+	mShaderCache.Init(mDevice);
+
 	mPipelineLayout = CreatePipelineLayout();
-	mGraphicsPipeline = CreateVulkanPipeline();
+	mPipelineRegistry.Init(mDevice, [this](const GraphicsPipelineDesc& desc) { return CreateVulkanPipeline(desc); });
+	mGraphicsPipelineDesc = MakeGraphicsPipelineDesc(ObjectDataPath::DynamicUniform);
+	mPushConstantPipelineDesc = MakeGraphicsPipelineDesc(ObjectDataPath::PushConstant);
+	mInstancedPipelineDesc = MakeGraphicsPipelineDesc(ObjectDataPath::StorageBuffer);
+	mGraphicsPipeline = mPipelineRegistry.GetBlocking(mGraphicsPipelineDesc);
+	mPushConstantPipeline = mPipelineRegistry.GetBlocking(mPushConstantPipelineDesc);
+	mInstancedPipeline = mPipelineRegistry.GetBlocking(mInstancedPipelineDesc);
+	mCullPipelineLayout = CreateCullPipelineLayout();
+	mCullPipeline = CreateComputePipeline("./Shaders/cull.spv", mCullPipelineLayout);
+
+	for (const auto& shader : watchedShaders)
+		mShaderWatcher.Watch(shader.sourcePath, shader.spirvPath);
+
+	printf("Pipelines created in %.2f ms (%s cache, %zu bytes loaded), %u shader files read, %u modules created\n",
+		pipelineTimer.PeekTime() * 1000.0, mPipelineCache.IsWarm() ? "warm" : "cold", mPipelineCache.GetLoadedBytes(),
+		mShaderCache.GetFileReads(), mShaderCache.GetModulesCreated());
+
+	// Compiled in the background so the first switch to wireframe is already a cache hit.
+	for (GraphicsPipelineDesc desc : { mGraphicsPipelineDesc, mPushConstantPipelineDesc, mInstancedPipelineDesc })
+	{
+		desc.PolygonMode = VK_POLYGON_MODE_LINE;
+		mPipelineRegistry.Request(desc);
+	}
 }
 
 Renderer::~Renderer()
 {
+	// The watcher thread builds pipelines, it has to be gone before anything it uses.
+	mShaderWatcher.Stop();
 	vkDeviceWaitIdle(mDevice);
+	for (ReloadedPipeline& reloaded : mReloadedPipelines)
+		vkDestroyPipeline(mDevice, reloaded.Pipeline, nullptr);
+	ReleaseRetiredPipelines(true);
+	// Joins the compile thread before the render pass and layouts it builds with go away.
+	mPipelineRegistry.Release();
 	for (FrameResources& frameRes : mFrameResources) {
 		vkFreeDescriptorSets(mDevice, mGlobalDescriptorPool, 1u, &frameRes.GlobalDescriptorSet);
 		vkDestroySemaphore(mDevice, frameRes.ImageAcquired, nullptr);
-		vkDestroySemaphore(mDevice, frameRes.ImagePresented, nullptr);
-		vkDestroyFence(mDevice, frameRes.Fence, nullptr);
-		vkDestroyFramebuffer(mDevice, frameRes.Framebuffer, nullptr);
-		vkFreeCommandBuffers(mDevice, frameRes.CommandPool, 1u, &frameRes.CommandBuffer);
-		vkDestroyCommandPool(mDevice, frameRes.CommandPool, nullptr);
+		DestroyImageCommandBuffers(frameRes);
 	}
+	delete mRecordThreads;
 	vkDestroyImageView(mDevice, mDepthBuffer.imageView, nullptr);
 	vkDestroyImage(mDevice, mDepthBuffer.image, nullptr);
-	vkFreeMemory(mDevice, mDepthBuffer.memory, nullptr);
+	mAllocator->Free(mDepthBuffer.allocation);
+	mObjectUniformRing.Release();
 	DestroyBuffer(&mObjectUniformBuffer);
+	mInstanceRing.Release();
+	DestroyBuffer(&mInstanceBuffer);
+	mIndirectRing.Release();
+	DestroyBuffer(&mIndirectBuffer);
+	mDrawCountRing.Release();
+	DestroyBuffer(&mDrawCountBuffer);
+	DestroyBuffer(&mCullItemBuffer);
 	vkDestroyDescriptorSetLayout(mDevice, mGlobalDescriptorSetLayout, nullptr);
+	vkDestroyDescriptorSetLayout(mDevice, mObjectDescriptorSetLayout, nullptr);
+	vkDestroyDescriptorSetLayout(mDevice, mInstanceDescriptorSetLayout, nullptr);
+	vkDestroyDescriptorSetLayout(mDevice, mCullDescriptorSetLayout, nullptr);
 	vkDestroyDescriptorPool(mDevice, mGlobalDescriptorPool, nullptr);
 	DestroyBuffer(&mMeshGeometry.IndexBuffer);
 	DestroyBuffer(&mMeshGeometry.VertexBuffer);
+	mGlobalUniformRing.Release();
 	DestroyBuffer(&mGlobalUniformBuffer);
 	vkDestroyRenderPass(mDevice, mRenderpass, nullptr);
 	vkDestroyPipelineLayout(mDevice, mPipelineLayout, nullptr);
-	vkDestroyPipeline(mDevice, mGraphicsPipeline, nullptr);
-	for (VkImageView imageView : mImageViews)
-		vkDestroyImageView(mDevice, imageView, nullptr);
+	vkDestroyPipeline(mDevice, mCullPipeline, nullptr);
+	vkDestroyPipelineLayout(mDevice, mCullPipelineLayout, nullptr);
+	mShaderCache.Release();
+	mPipelineCache.Save();
+	mPipelineCache.Release();
+	DestroySwapchainImageResources();
 	vkDestroySwapchainKHR(mDevice, mSwapchain, nullptr);
+	ReleaseRetiredSwapchains(true);
 	vkDestroySurfaceKHR(mInstance, mSurface, nullptr);
 	vkFreeCommandBuffers(mDevice, mMainCmdPool, 1u, &mMainCmd);
 	vkDestroyCommandPool(mDevice, mMainCmdPool, nullptr);
-	vkFreeCommandBuffers(mDevice, mMainTransferCmdPool, 1u, &mMainTransferCmd);
+	WaitForUploads();
+	for (UploadContext& context : mFreeUploadContexts)
+		vkFreeCommandBuffers(mDevice, mMainTransferCmdPool, 1u, &context.CommandBuffer);
+	vkDestroySemaphore(mDevice, mTransferTimeline, nullptr);
+	vkDestroySemaphore(mDevice, mGraphicsTimeline, nullptr);
+	mStagingRing.Release();
+	DestroyBuffer(&mStagingBuffer);
 	vkDestroyCommandPool(mDevice, mMainTransferCmdPool, nullptr);
+	delete mAllocator;
 	vkDestroyDevice(mDevice, nullptr);
 #ifdef _DEBUG
 	PFN_vkDestroyDebugUtilsMessengerEXT func = (PFN_vkDestroyDebugUtilsMessengerEXT)
@@ -171,81 +264,70 @@ Renderer::~Renderer()
 
 void Renderer::NotifyWindowResize(int width, int height)
 {
-	if (!this) return;
-	vkDeviceWaitIdle(mDevice);
-	for (uint32_t i = 0; i < mImageCount; i++)
-	{
-		// Destroy frame resources
-		vkDestroySemaphore(mDevice, mFrameResources[i].ImageAcquired, nullptr);
-		vkDestroySemaphore(mDevice, mFrameResources[i].ImagePresented, nullptr);
-		vkDestroyFence(mDevice, mFrameResources[i].Fence, nullptr);
-		vkFreeCommandBuffers(mDevice, mFrameResources[i].CommandPool, 1u, &mFrameResources[i].CommandBuffer);
-		vkDestroyCommandPool(mDevice, mFrameResources[i].CommandPool, nullptr);
-		vkDestroyFramebuffer(mDevice, mFrameResources[i].Framebuffer, nullptr);
-		memset(&mFrameResources[i], 0, sizeof(mFrameResources[i]));
-	}
-	vkDestroyRenderPass(mDevice, mRenderpass, nullptr);
-	vkDestroyImageView(mDevice, mDepthBuffer.imageView, nullptr);
-	vkFreeMemory(mDevice, mDepthBuffer.memory, nullptr);
-	vkDestroyImage(mDevice, mDepthBuffer.image, nullptr);
-	vkDestroySwapchainKHR(mDevice, mSwapchain, nullptr);
-
-	mSwapchain = CreateSwapchain(mSwapchainSurfaceFormat);
-	mImageCount = GetSwapchainImagesCount();
-	mImages = GetSwapchainImages(mImageCount);
-	mDepthBuffer = CreateDepthBuffer();
-	mRenderpass = CreateRenderPass();
-
-	for (VkImage image : mImages)
-	{
-		VkImageView imgView = CreateImageView(mSwapchainSurfaceFormat.format, image, VK_IMAGE_ASPECT_COLOR_BIT);
-		mImageViews.push_back(imgView);
+	// A minimized window has nothing to present to, the next restore recreates the swapchain.
+	if (width == 0 || height == 0)
+		return;
 
-		FrameResources frameRes;
-		frameRes.ImageAcquired = CreateSemaphore();
-		frameRes.ImagePresented = CreateSemaphore();
-		frameRes.Fence = CreateVulkanFence();
-		frameRes.CommandPool = CreateCommandPool(mDeviceInfo.graphicsQueueIndex);
-		frameRes.CommandBuffer = AllocateCommandBuffer(frameRes.CommandPool);
-		VkImageView imgViews[] = { imgView, mDepthBuffer.imageView };
-		frameRes.Framebuffer = CreateFramebuffer(mRenderpass, 2, imgViews, mWindow->GetWindowWidth(), mWindow->GetWindowHeight());
-		mFrameResources.push_back(frameRes);
-	}
+	if (mSwapchainExtent.width == static_cast<uint32_t>(width) && mSwapchainExtent.height == static_cast<uint32_t>(height))
+		return;
 
-	VkSurfaceCapabilitiesKHR surfaceCapabilities;
-	VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(
-		mPhysicalDevice.physicalDevice,
-		mSurface,
-		&surfaceCapabilities
-	));
+	RecreateSwapchain();
+}
 
+void Renderer::UpdateViewportAndScissor()
+{
 	mViewport.minDepth = 0.0f;
 	mViewport.maxDepth = 1.0f;
-	mViewport.width = static_cast<float>(surfaceCapabilities.currentExtent.width);
-	mViewport.height = -static_cast<float>(surfaceCapabilities.currentExtent.height);
+	mViewport.width = static_cast<float>(mSwapchainExtent.width);
+	mViewport.height = -static_cast<float>(mSwapchainExtent.height);
 	mViewport.x = 0.0f;
-	mViewport.y = static_cast<float>(surfaceCapabilities.currentExtent.height);
+	mViewport.y = static_cast<float>(mSwapchainExtent.height);
 
-	mScissor.extent = surfaceCapabilities.currentExtent;
+	mScissor.extent = mSwapchainExtent;
 	mScissor.offset = { 0, 0 };
 }
 
 void Renderer::Update()
 {
-	VkSemaphore imgAcq = mFrameResources[mCurrentImageIndex].ImageAcquired;
+	VkSemaphore imgAcq = mFrameResources[mCurrentFrameIndex].ImageAcquired;
 	
-	VK_CHECK(vkWaitForFences(mDevice, 1u, &mFrameResources[mCurrentImageIndex].Fence, VK_TRUE, UINT64_MAX));
+	// The frame's slices and command buffers are free again once its last submit is done.
+	uint64_t frameValue = mFrameResources[mCurrentFrameIndex].TimelineValue;
+	if (!IsGraphicsValueComplete(frameValue))
+	{
+		WaitForTimelineValue(mGraphicsTimeline, frameValue);
+		mGraphicsCompletedValue = frameValue;
+	}
+	ReleaseRetiredSwapchains(false);
+	ApplyReloadedPipelines();
+	ReleaseRetiredPipelines(false);
+	ResolveGraphicsPipelines();
 
-	VK_CHECK(vkAcquireNextImageKHR(
-		mDevice,
-		mSwapchain,
-		UINT64_MAX,
-		imgAcq,
-		nullptr,
-		&mNextImageIndex
-	));
+	if (mDrawPath == DrawPath::GpuCulled)
+		ReadBackVisibleCount();
+
+	if (mSwapchainOutOfDate)
+	{
+		mSwapchainOutOfDate = false;
+		RecreateSwapchain();
+	}
+
+	mAcquireTimer.MarkTime();
+	VkResult acquireResult = vkAcquireNextImageKHR(mDevice, mSwapchain, UINT64_MAX, imgAcq, nullptr, &mNextImageIndex);
+	if (acquireResult == VK_ERROR_OUT_OF_DATE_KHR)
+	{
+		// The window changed before its WM_SIZE got here, a failed acquire leaves the semaphore untouched.
+		RecreateSwapchain();
+		acquireResult = vkAcquireNextImageKHR(mDevice, mSwapchain, UINT64_MAX, imgAcq, nullptr, &mNextImageIndex);
+	}
+	// Suboptimal still hands out an image that can be presented.
+	if (acquireResult != VK_SUBOPTIMAL_KHR)
+		VK_CHECK(acquireResult);
+	mPresentModeStats.acquireTime += mAcquireTimer.PeekTime();
 
 	CalculateDeltaTime();
+	mPresentModeStats.frameTime += mDeltaTime;
+	mPresentModeStats.frameCount++;
 
 	float _x = mRadius * sinf(mPhi) * cosf(mTheta);
 	float _y = mRadius * cosf(mPhi);
@@ -262,27 +344,129 @@ void Renderer::Update()
 
 	rotation += 2.0f * (float)mDeltaTime;
 
-	for (RenderItem& rItem : mRenderItems) 
+	UpdateGlobalUniformData(mGlobalUniform);
+	CullRenderItems();
+
+	// An updated item may have a new mesh or submesh, none of the cached recordings can be trusted anymore.
+	bool itemsUpdated = false;
+	for (RenderItem& rItem : mRenderItems)
 	{
-		const Buffer& UB = *mFrameResources[mCurrentImageIndex].ObjectUniformBuffer;
-		uint64_t frameOffset = (uint64_t)mCurrentImageIndex * mRenderItems.size();
-		UpdateUniformBuffer(UB, sizeof(SingleObjectUniform), frameOffset + rItem.uniformBufferIndex, &rItem.UniformBuffer);
+		itemsUpdated |= rItem.updated;
+		rItem.updated = false;
 	}
-	UpdateGlobalUniformData(mGlobalUniform);
-	UpdateUniformBuffer(mGlobalUniformBuffer, sizeof(GlobalUniform), (uint64_t)mCurrentImageIndex, &mGlobalUniform);
+	if (itemsUpdated)
+		InvalidateCommandBuffers();
+
+	// The timeline wait above guarantees the GPU is done reading this frame's slices.
+	if (mDrawPath == DrawPath::Direct)
+	{
+		if (mObjectDataPath == ObjectDataPath::StorageBuffer)
+		{
+			WriteObjectData();
+		}
+		else if (mObjectDataPath == ObjectDataPath::DynamicUniform)
+		{
+			mObjectUniformRing.BeginFrame(mCurrentFrameIndex);
+			for (RenderItem& rItem : mRenderItems) 
+			{
+				// Items are pushed in uniformBufferIndex order, so the draws can compute their dynamic offsets from it.
+				VkDeviceSize offset = mObjectUniformRing.Push(&rItem.UniformBuffer, sizeof(SingleObjectUniform));
+				assert(offset == mObjectUniformRing.GetFrameOffset(mCurrentFrameIndex) + rItem.uniformBufferIndex * CalculateUniformBufferSize(sizeof(SingleObjectUniform)));
+			}
+		}
+	}
+	else
+	{
+		WriteInstanceData();
+		if (mDrawPath == DrawPath::Indirect)
+			WriteIndirectCommands();
+	}
+	mGlobalUniformRing.BeginFrame(mCurrentFrameIndex);
+	mGlobalUniformRing.Push(&mGlobalUniform, sizeof(GlobalUniform));
 	//printf("End frame %u\n", mImageIndex);
 }
 
 void Renderer::Draw()
 {
-	VkFence fence = mFrameResources[mCurrentImageIndex].Fence;
-	VkSemaphore imgPrst = mFrameResources[mCurrentImageIndex].ImagePresented;
-	VkSemaphore imgAcq = mFrameResources[mCurrentImageIndex].ImageAcquired;
-	VkCommandBuffer cmdBuf = mFrameResources[mCurrentImageIndex].CommandBuffer;
-	VkCommandPool cmdPool = mFrameResources[mCurrentImageIndex].CommandPool;
-	VkFramebuffer frameBuffer = mFrameResources[mCurrentImageIndex].Framebuffer;
+	FrameResources& frameRes = mFrameResources[mCurrentFrameIndex];
+	VkSemaphore imgPrst = mPresentSemaphores[mNextImageIndex];
+	VkSemaphore imgAcq = frameRes.ImageAcquired;
+	ImageCommandBuffers& commands = frameRes.ImageCommands[mNextImageIndex];
+	VkCommandBuffer cmdBuf = commands.CommandBuffer;
+
+	mRecordTimer.MarkTime();
+	if (CanReuseCommandBuffer(commands))
+	{
+		mReusedCommandBuffer = true;
+		mDrawCallCount = commands.DrawCallCount;
+		mAvoidedBindCount = commands.AvoidedBindCount;
+	}
+	else
+		RecordCommandBuffer(commands);
+	mRecordTimeAccum += mRecordTimer.PeekTime();
+	mRecordedFrames++;
+
+	// Only frames that use freshly uploaded data wait on the transfer queue, and only at the stages reading it.
+	VkSemaphore waitSemaphores[] = { imgAcq, mTransferTimeline };
+	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, uploadConsumerStages };
+	uint64_t waitValues[] = { 0, mGraphicsUploadWaitValue };
+	uint32_t waitCount = mGraphicsUploadWaitValue != 0 ? 2u : 1u;
+
+	// The present semaphore has to stay binary, the timeline value is ignored for it.
+	frameRes.TimelineValue = ++mGraphicsTimelineValue;
+	VkSemaphore signalSemaphores[] = { imgPrst, mGraphicsTimeline };
+	uint64_t signalValues[] = { 0, frameRes.TimelineValue };
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo;
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.pNext = nullptr;
+	timelineInfo.waitSemaphoreValueCount = waitCount;
+	timelineInfo.pWaitSemaphoreValues = waitValues;
+	timelineInfo.signalSemaphoreValueCount = static_cast<uint32_t>(std::size(signalValues));
+	timelineInfo.pSignalSemaphoreValues = signalValues;
 
-	VK_CHECK(vkResetFences(mDevice, 1u, &fence));
+	VkSubmitInfo submitInfo;
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = &timelineInfo;
+	submitInfo.waitSemaphoreCount = waitCount;
+	submitInfo.pWaitSemaphores = waitSemaphores;
+	submitInfo.signalSemaphoreCount = static_cast<uint32_t>(std::size(signalSemaphores));
+	submitInfo.pSignalSemaphores = signalSemaphores;
+	submitInfo.pWaitDstStageMask = waitStages;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &cmdBuf;
+	VK_CHECK(vkQueueSubmit(mGraphicsQueue, 1u, &submitInfo, nullptr));
+	mGraphicsUploadWaitValue = 0;
+
+	VkPresentInfoKHR presentInfo;
+	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+	presentInfo.pNext = nullptr;
+	presentInfo.pSwapchains = &mSwapchain;
+	presentInfo.swapchainCount = 1;
+	presentInfo.waitSemaphoreCount = 1;
+	presentInfo.pWaitSemaphores = &imgPrst;
+	presentInfo.pImageIndices = &mNextImageIndex;
+	presentInfo.pResults = 0;
+
+	VkResult res = vkQueuePresentKHR(mGraphicsQueue, &presentInfo);
+
+	// The window changed under the swapchain, handled like a resize before the next acquire.
+	if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR)
+		mSwapchainOutOfDate = true;
+	else
+		VK_CHECK(res);
+
+	mCurrentFrameIndex = (mCurrentFrameIndex + 1) % framesInFlight;
+}
+
+void Renderer::RecordCommandBuffer(ImageCommandBuffers& commands)
+{
+	VkCommandBuffer cmdBuf = commands.CommandBuffer;
+	VkCommandPool cmdPool = commands.CommandPool;
+	VkFramebuffer frameBuffer = mFramebuffers[mNextImageIndex];
+	// Acquire barriers must only run once, so a buffer that records them can't be reused.
+	bool recordsAcquires = !mPendingAcquireBarriers.empty();
+	mReusedCommandBuffer = false;
 
 	VK_CHECK(vkResetCommandPool(mDevice, cmdPool, 0));
 	VK_CHECK(vkResetCommandBuffer(cmdBuf, 0));
@@ -296,6 +480,28 @@ void Renderer::Draw()
 
 	VK_CHECK(vkBeginCommandBuffer(cmdBuf, &cmdBeginInfo));
 
+	if (!mPendingAcquireBarriers.empty())
+	{
+		// Take ownership of the buffers the transfer queue released since the last frame.
+		vkCmdPipelineBarrier(
+			cmdBuf,
+			uploadConsumerStages,
+			uploadConsumerStages,
+			0,
+			0u,
+			nullptr,
+			static_cast<uint32_t>(mPendingAcquireBarriers.size()),
+			mPendingAcquireBarriers.data(),
+			0u,
+			nullptr
+		);
+		mPendingAcquireBarriers.clear();
+	}
+
+	// Dispatches can't be recorded inside a render pass.
+	if (mDrawPath == DrawPath::GpuCulled)
+		RecordCullDispatch(cmdBuf);
+
 	VkClearValue clearValues[2];
 	clearValues[0].color.float32[0] = 0.2f;
 	clearValues[0].color.float32[1] = 0.2f;
@@ -310,88 +516,601 @@ void Renderer::Draw()
 	renderPassBeginInfo.pNext = nullptr;
 	renderPassBeginInfo.renderPass = mRenderpass;
 	renderPassBeginInfo.framebuffer = frameBuffer;
-	renderPassBeginInfo.renderArea.extent.width = mWindow->GetWindowWidth();
-	renderPassBeginInfo.renderArea.extent.height = mWindow->GetWindowHeight();
+	renderPassBeginInfo.renderArea.extent = mSwapchainExtent;
 	renderPassBeginInfo.renderArea.offset.x = 0;
 	renderPassBeginInfo.renderArea.offset.y = 0;
 	renderPassBeginInfo.clearValueCount = (uint32_t)std::size(clearValues);
 	renderPassBeginInfo.pClearValues = clearValues;
 
-	vkCmdBeginRenderPass(cmdBuf, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+	// A subpass holds either inline commands or secondary command buffers, never both.
+	bool recordSecondaries = mDrawPath == DrawPath::Direct && mParallelRecording;
+	vkCmdBeginRenderPass(cmdBuf, &renderPassBeginInfo, recordSecondaries ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
 
-	vkCmdSetViewport(cmdBuf, 0u, 1u, &mViewport);
-	vkCmdSetScissor(cmdBuf, 0u, 1u, &mScissor);
+	if (!recordSecondaries)
+	{
+		vkCmdSetViewport(cmdBuf, 0u, 1u, &mViewport);
+		vkCmdSetScissor(cmdBuf, 0u, 1u, &mScissor);
+	}
 
-	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, mGraphicsPipeline);
+	if (recordSecondaries)
+		RecordDirectDrawsParallel(cmdBuf, commands);
+	else if (mDrawPath == DrawPath::Direct)
+		RecordDirectDraws(cmdBuf);
+	else if (mDrawPath == DrawPath::Instanced)
+		RecordInstancedDraws(cmdBuf);
+	else
+		RecordIndirectDraws(cmdBuf);
 
-	for (size_t i = 0; i < mRenderItems.size(); i++) {
-		RenderItem& rItem = mRenderItems[i];
+	vkCmdEndRenderPass(cmdBuf);
+	vkEndCommandBuffer(cmdBuf);
+
+	commands.Recorded = !recordsAcquires;
+	commands.RecordedVisibility = mItemVisibility;
+	commands.RecordedView = mGlobalUniform.view;
+	commands.DrawCallCount = mDrawCallCount;
+	commands.AvoidedBindCount = mAvoidedBindCount;
+}
+
+bool Renderer::CanReuseCommandBuffer(const ImageCommandBuffers& commands) const
+{
+	if (!mCachedCommandBuffers || !commands.Recorded)
+		return false;
+
+	// Finished uploads have acquire barriers waiting to be recorded.
+	if (!mPendingAcquireBarriers.empty())
+		return false;
+
+	// Push constants bake the camera into the commands.
+	if (mDrawPath == DrawPath::Direct && mObjectDataPath == ObjectDataPath::PushConstant)
+		return false;
+
+	// Reusing it after the camera moved would keep the front to back order of the old view.
+	if (mDrawPath == DrawPath::Direct && memcmp(&commands.RecordedView, &mGlobalUniform.view, sizeof(mGlobalUniform.view)) != 0)
+		return false;
+
+	// Culling decides which draws and instance counts get recorded, everything else comes from mapped buffers.
+	return commands.RecordedVisibility == mItemVisibility;
+}
+
+void Renderer::InvalidateCommandBuffers()
+{
+	for (FrameResources& frameRes : mFrameResources)
+		for (ImageCommandBuffers& commands : frameRes.ImageCommands)
+			commands.Recorded = false;
+}
+
+void Renderer::BuildRenderQueue()
+{
+	// Only one pipeline takes this path for now, so its id is always 0.
+	XMMATRIX view = XMLoadFloat4x4(&mGlobalUniform.view);
+	mRenderQueue.Clear();
+	for (uint32_t i = 0; i < static_cast<uint32_t>(mRenderItems.size()); i++)
+	{
+		if (!mItemVisibility[i])
+			continue;
 
-		VkDescriptorSet descriptorSets[] =
+		const RenderItem& rItem = mRenderItems[i];
+		XMVECTOR center = XMVector3TransformCoord(XMLoadFloat3(&rItem.Bounds.Center), XMLoadFloat4x4(&rItem.UniformBuffer.model));
+		float depth = XMVectorGetZ(XMVector3TransformCoord(center, view));
+		mRenderQueue.Push(RenderQueue::MakeSortKey(0, rItem.meshId, rItem.instanceBatch, depth), i);
+	}
+	mRenderQueue.Sort();
+}
+
+uint32_t Renderer::BindDirectPipeline(VkCommandBuffer cmdBuf) const
+{
+	if (mObjectDataPath == ObjectDataPath::StorageBuffer)
+	{
+		// The storage buffer variant reads its transform at gl_InstanceIndex, like the instanced path.
+		BindInstancedPipeline(cmdBuf);
+		return 2;
+	}
+
+	VkPipeline pipeline = mObjectDataPath == ObjectDataPath::PushConstant ? mPushConstantPipeline : mGraphicsPipeline;
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+
+	// The push constant variant doesn't read any set, but it still has to have all of them bound.
+	// The dynamic uniform path rebinds set 1 with the offset of every draw.
+	BindSceneDescriptorSets(cmdBuf);
+	return 2;
+}
+
+uint32_t Renderer::RecordDirectDrawRange(VkCommandBuffer cmdBuf, size_t begin, size_t end, uint32_t& out_bindCount) const
+{
+	uint32_t drawCount = 0;
+	VkDeviceSize objectFrameOffset = mObjectUniformRing.GetFrameOffset(mCurrentFrameIndex);
+	VkDeviceSize objectSlotSize = CalculateUniformBufferSize(sizeof(SingleObjectUniform));
+	XMMATRIX viewProj = XMLoadFloat4x4(&mGlobalUniform.viewProj);
+
+	const MeshGeometry* boundGeometry = nullptr;
+	for (size_t i = begin; i < end; i++)
+	{
+		uint32_t itemIndex = mRenderQueue.GetItem(i);
+		const RenderItem& rItem = mRenderItems[itemIndex];
+
+		if (mObjectDataPath == ObjectDataPath::PushConstant)
 		{
-			mFrameResources[mCurrentImageIndex].GlobalDescriptorSet,
-			mFrameResources[mCurrentImageIndex].ObjectDescriptorSet[i]
-		};
+			// Stored untransposed like the uniforms, so GLSL multiplies it on the left of the position.
+			ObjectPushConstants pushConstants;
+			XMStoreFloat4x4(&pushConstants.modelViewProj, XMMatrixMultiply(XMLoadFloat4x4(&rItem.UniformBuffer.model), viewProj));
+			vkCmdPushConstants(cmdBuf, mPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0u, sizeof(ObjectPushConstants), &pushConstants);
+		}
+		else if (mObjectDataPath == ObjectDataPath::DynamicUniform)
+		{
+			// Same set for every draw, only the offset of the object slot changes.
+			uint32_t dynamicOffset = static_cast<uint32_t>(objectFrameOffset + rItem.uniformBufferIndex * objectSlotSize);
+			vkCmdBindDescriptorSets(
+				cmdBuf,
+				VK_PIPELINE_BIND_POINT_GRAPHICS,
+				mPipelineLayout,
+				1u,
+				1u,
+				&mFrameResources[mCurrentFrameIndex].ObjectDescriptorSet,
+				1u,
+				&dynamicOffset
+			);
+			out_bindCount++;
+		}
+
+		if (rItem.MeshGeo != boundGeometry)
+		{
+			VkDeviceSize s = 0;
+			vkCmdBindVertexBuffers(cmdBuf, 0u, 1u, &rItem.MeshGeo->VertexBuffer.buffer, &s);
+			vkCmdBindIndexBuffer(cmdBuf, rItem.MeshGeo->IndexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+			boundGeometry = rItem.MeshGeo;
+			out_bindCount += 2;
+		}
+
+		// The item index picks the object slot of the storage buffer path, the other variants ignore gl_InstanceIndex.
+		vkCmdDrawIndexed(cmdBuf, rItem.indexCount, 1u, rItem.firstIndex, rItem.vertexOffset, itemIndex);
+		drawCount++;
+	}
+
+	return drawCount;
+}
+
+void Renderer::RecordDirectDraws(VkCommandBuffer cmdBuf)
+{
+	BuildRenderQueue();
+
+	uint32_t bindCount = BindDirectPipeline(cmdBuf);
+	mDrawCallCount = RecordDirectDrawRange(cmdBuf, 0, mRenderQueue.GetSize(), bindCount);
+
+	// Binding everything for every draw costs the pipeline plus a descriptor, vertex and index bind per draw.
+	uint32_t naiveBindCount = 1 + 3 * mDrawCallCount;
+	mAvoidedBindCount = naiveBindCount > bindCount ? naiveBindCount - bindCount : 0;
+}
+
+void Renderer::RecordDirectDrawsParallel(VkCommandBuffer cmdBuf, ImageCommandBuffers& commands)
+{
+	BuildRenderQueue();
+
+	size_t itemCount = mRenderQueue.GetSize();
+	size_t neededThreads = (itemCount + minDrawsPerRecordThread - 1) / minDrawsPerRecordThread;
+	uint32_t workerCount = static_cast<uint32_t>(std::min<size_t>(neededThreads, mRecordThreads->GetThreadCount()));
+
+	VkCommandBufferInheritanceInfo inheritanceInfo = {};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.renderPass = mRenderpass;
+	inheritanceInfo.subpass = 0;
+	inheritanceInfo.framebuffer = mFramebuffers[mNextImageIndex];
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	// Not one time submit, the primary buffer running them may be cached and submitted again.
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+	beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+	uint32_t drawCounts[maxRecordThreads] = {};
+	uint32_t bindCounts[maxRecordThreads] = {};
+
+	mRecordThreads->Run(workerCount, [&](uint32_t worker)
+	{
+		// Contiguous slices of the sorted queue, so most of the redundant binds are still skipped inside each one.
+		size_t begin = itemCount * worker / workerCount;
+		size_t end = itemCount * (worker + 1) / workerCount;
+		VkCommandBuffer secondary = commands.SecondaryCommandBuffers[worker];
+
+		VK_CHECK(vkResetCommandPool(mDevice, commands.SecondaryCommandPools[worker], 0));
+		VK_CHECK(vkBeginCommandBuffer(secondary, &beginInfo));
+
+		// Dynamic state isn't inherited from the primary command buffer.
+		vkCmdSetViewport(secondary, 0u, 1u, &mViewport);
+		vkCmdSetScissor(secondary, 0u, 1u, &mScissor);
+		bindCounts[worker] = BindDirectPipeline(secondary);
+
+		drawCounts[worker] = RecordDirectDrawRange(secondary, begin, end, bindCounts[worker]);
+
+		VK_CHECK(vkEndCommandBuffer(secondary));
+	});
+
+	if (workerCount > 0)
+		vkCmdExecuteCommands(cmdBuf, workerCount, commands.SecondaryCommandBuffers.data());
+
+	uint32_t bindCount = 0;
+	mDrawCallCount = 0;
+	for (uint32_t i = 0; i < workerCount; i++)
+	{
+		mDrawCallCount += drawCounts[i];
+		bindCount += bindCounts[i];
+	}
 
-		vkCmdBindDescriptorSets(
+	// Every secondary binds the pipeline and the sets again, so this saves a little less than the single threaded path.
+	uint32_t naiveBindCount = 1 + 3 * mDrawCallCount;
+	mAvoidedBindCount = naiveBindCount > bindCount ? naiveBindCount - bindCount : 0;
+}
+
+void Renderer::RecordInstancedDraws(VkCommandBuffer cmdBuf)
+{
+	BindInstancedPipeline(cmdBuf);
+
+	mDrawCallCount = 0;
+
+	const MeshGeometry* boundGeometry = nullptr;
+	for (size_t i = 0; i < mInstanceBatches.size(); i++)
+	{
+		const InstanceBatch& batch = mInstanceBatches[i];
+		if (mBatchVisibleCounts[i] == 0)
+			continue;
+
+		if (batch.MeshGeo != boundGeometry)
+		{
+			VkDeviceSize s = 0;
+			vkCmdBindVertexBuffers(cmdBuf, 0u, 1u, &batch.MeshGeo->VertexBuffer.buffer, &s);
+			vkCmdBindIndexBuffer(cmdBuf, batch.MeshGeo->IndexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+			boundGeometry = batch.MeshGeo;
+		}
+
+		// gl_InstanceIndex starts at firstInstance, so it indexes the instance buffer directly.
+		vkCmdDrawIndexed(
 			cmdBuf,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			mPipelineLayout,
-			0u,
-			(uint32_t)std::size(descriptorSets),
-			descriptorSets,
-			0u,
-			nullptr
+			batch.indexCount,
+			mBatchVisibleCounts[i],
+			batch.firstIndex,
+			batch.vertexOffset,
+			batch.firstInstance
 		);
+		mDrawCallCount++;
+	}
+}
+
+void Renderer::RecordIndirectDraws(VkCommandBuffer cmdBuf)
+{
+	BindInstancedPipeline(cmdBuf);
+
+	const VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+	VkDeviceSize frameOffset = mIndirectRing.GetFrameOffset(mCurrentFrameIndex);
+	VkDeviceSize countFrameOffset = mDrawCountRing.GetFrameOffset(mCurrentFrameIndex);
+	bool useDrawCount = mDrawPath == DrawPath::GpuCulled && mDeviceInfo.drawIndirectCount;
+	mDrawCallCount = 0;
+
+	for (uint32_t i = 0; i < static_cast<uint32_t>(mIndirectRanges.size()); i++)
+	{
+		const IndirectDrawRange& range = mIndirectRanges[i];
+		VkDeviceSize commandOffset = frameOffset + range.firstCommand * stride;
+		// The GPU culled path always has the whole range, the CPU paths only wrote the visible commands.
+		uint32_t commandCount = mDrawPath == DrawPath::GpuCulled ? range.commandCount : mRangeVisibleCounts[i];
+		if (commandCount == 0)
+			continue;
 
 		VkDeviceSize s = 0;
-		vkCmdBindVertexBuffers(cmdBuf, 0u, 1u, &rItem.MeshGeo->VertexBuffer.buffer, &s);
-		vkCmdBindIndexBuffer(cmdBuf, rItem.MeshGeo->IndexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
-		vkCmdDrawIndexed(cmdBuf, rItem.indexCount, 1u, rItem.firstIndex, rItem.vertexOffset, 0u);
+		vkCmdBindVertexBuffers(cmdBuf, 0u, 1u, &range.MeshGeo->VertexBuffer.buffer, &s);
+		vkCmdBindIndexBuffer(cmdBuf, range.MeshGeo->IndexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+
+		if (useDrawCount)
+		{
+			// The culling pass compacted the visible commands to the front of the range and counted them.
+			vkCmdDrawIndexedIndirectCount(
+				cmdBuf,
+				mIndirectBuffer.buffer,
+				commandOffset,
+				mDrawCountBuffer.buffer,
+				countFrameOffset + i * sizeof(uint32_t),
+				commandCount,
+				(uint32_t)stride
+			);
+			mDrawCallCount++;
+		}
+		else if (mDeviceInfo.multiDrawIndirect)
+		{
+			vkCmdDrawIndexedIndirect(cmdBuf, mIndirectBuffer.buffer, commandOffset, commandCount, (uint32_t)stride);
+			mDrawCallCount++;
+		}
+		else
+		{
+			// Without multiDrawIndirect the draw count must be 1, the commands are still read by the GPU.
+			for (uint32_t j = 0; j < commandCount; j++)
+				vkCmdDrawIndexedIndirect(cmdBuf, mIndirectBuffer.buffer, commandOffset + j * stride, 1u, (uint32_t)stride);
+			mDrawCallCount += commandCount;
+		}
 	}
+}
 
-	vkCmdEndRenderPass(cmdBuf);
-	vkEndCommandBuffer(cmdBuf);
+void Renderer::RecordCullDispatch(VkCommandBuffer cmdBuf)
+{
+	VkDeviceSize countOffset = mDrawCountRing.GetFrameOffset(mCurrentFrameIndex);
+	VkDeviceSize countSize = mIndirectRanges.size() * sizeof(uint32_t);
+
+	vkCmdFillBuffer(cmdBuf, mDrawCountBuffer.buffer, countOffset, countSize, 0u);
+
+	VkBufferMemoryBarrier clearBarrier;
+	clearBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	clearBarrier.pNext = nullptr;
+	clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	clearBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	clearBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	clearBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	clearBarrier.buffer = mDrawCountBuffer.buffer;
+	clearBarrier.offset = countOffset;
+	clearBarrier.size = countSize;
+
+	vkCmdPipelineBarrier(
+		cmdBuf,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0,
+		0u,
+		nullptr,
+		1u,
+		&clearBarrier,
+		0u,
+		nullptr
+	);
 
-	VkSubmitInfo submitInfo;
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.pNext = nullptr;
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &imgAcq;
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &imgPrst;
-	VkPipelineStageFlags stageFlags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	submitInfo.pWaitDstStageMask = &stageFlags;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &cmdBuf;
-	VK_CHECK(vkQueueSubmit(mGraphicsQueue, 1u, &submitInfo, fence));
+	CullParams params;
+	params.itemCount = static_cast<uint32_t>(mRenderItems.size());
+	params.compact = mDeviceInfo.drawIndirectCount ? 1u : 0u;
 
-	VkPresentInfoKHR presentInfo;
-	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-	presentInfo.pNext = nullptr;
-	presentInfo.pSwapchains = &mSwapchain;
-	presentInfo.swapchainCount = 1;
-	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = &imgPrst;
-	presentInfo.pImageIndices = &mNextImageIndex;
-	presentInfo.pResults = 0;
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_COMPUTE, mCullPipeline);
+	vkCmdBindDescriptorSets(
+		cmdBuf,
+		VK_PIPELINE_BIND_POINT_COMPUTE,
+		mCullPipelineLayout,
+		0u,
+		1u,
+		&mFrameResources[mCurrentFrameIndex].CullDescriptorSet,
+		0u,
+		nullptr
+	);
+	vkCmdPushConstants(cmdBuf, mCullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0u, sizeof(CullParams), &params);
+	vkCmdDispatch(cmdBuf, (params.itemCount + 63) / 64, 1u, 1u);
+
+	// The draws read the commands and counts, the host reads the counts once the frame's timeline value is reached.
+	VkMemoryBarrier cullBarrier;
+	cullBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	cullBarrier.pNext = nullptr;
+	cullBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	cullBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+
+	vkCmdPipelineBarrier(
+		cmdBuf,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+		0,
+		1u,
+		&cullBarrier,
+		0u,
+		nullptr,
+		0u,
+		nullptr
+	);
+}
 
-	VkResult res = vkQueuePresentKHR(mGraphicsQueue, &presentInfo);
+void Renderer::ReadBackVisibleCount()
+{
+	// Written by the last frame that used this slice, which the timeline wait just retired.
+	const uint32_t* counts = static_cast<const uint32_t*>(mDrawCountRing.GetFrameData(mCurrentFrameIndex));
+	mVisibleCount = 0;
+	for (size_t i = 0; i < mIndirectRanges.size(); i++)
+		mVisibleCount += counts[i];
+}
 
-	if (res == VK_SUCCESS || res == VK_SUBOPTIMAL_KHR)
+void Renderer::BindInstancedPipeline(VkCommandBuffer cmdBuf) const
+{
+	vkCmdBindPipeline(cmdBuf, VK_PIPELINE_BIND_POINT_GRAPHICS, mInstancedPipeline);
+	BindSceneDescriptorSets(cmdBuf);
+}
+
+void Renderer::BindSceneDescriptorSets(VkCommandBuffer cmdBuf) const
+{
+	const FrameResources& frameRes = mFrameResources[mCurrentFrameIndex];
+	VkDescriptorSet descriptorSets[] =
+	{
+		frameRes.GlobalDescriptorSet,
+		frameRes.ObjectDescriptorSet,
+		frameRes.InstanceDescriptorSet
+	};
+
+	// Set 1 points at the first object slot of the frame, a valid offset for the variants that never read it.
+	uint32_t objectOffset = static_cast<uint32_t>(mObjectUniformRing.GetFrameOffset(mCurrentFrameIndex));
+
+	vkCmdBindDescriptorSets(
+		cmdBuf,
+		VK_PIPELINE_BIND_POINT_GRAPHICS,
+		mPipelineLayout,
+		0u,
+		static_cast<uint32_t>(std::size(descriptorSets)),
+		descriptorSets,
+		1u,
+		&objectOffset
+	);
+}
+
+void Renderer::CullRenderItems()
+{
+	uint32_t itemCount = static_cast<uint32_t>(mRenderItems.size());
+
+	// The GPU culled path needs every instance in its slot, the compute pass does the culling.
+	if (!mCpuCulling || mDrawPath == DrawPath::GpuCulled)
 	{
+		mItemVisibility.assign(itemCount, 1);
+		if (mDrawPath != DrawPath::GpuCulled)
+			mVisibleCount = itemCount;
+		return;
 	}
-	else
+
+	for (uint32_t i = 0; i < itemCount; i++)
 	{
-		printf("Present fail\n");
+		const RenderItem& rItem = mRenderItems[i];
+		mFrustumCuller.SetBounds(i, rItem.Bounds.Center, rItem.Bounds.Extents, rItem.UniformBuffer.model);
+	}
+
+	mVisibleCount = mFrustumCuller.Cull(mGlobalUniform.viewProj, mItemVisibility);
+}
 
+void Renderer::WriteInstanceData()
+{
+	// The whole frame slice is handed out at once, the descriptor set points at its start.
+	mInstanceRing.BeginFrame(mCurrentFrameIndex);
+	VkDeviceSize offset = 0;
+	SingleObjectUniform* instances = static_cast<SingleObjectUniform*>(
+		mInstanceRing.Allocate(mRenderItems.size() * sizeof(SingleObjectUniform), offset));
+	assert(offset == mInstanceRing.GetFrameOffset(mCurrentFrameIndex));
+
+	// Visible instances are packed at the start of their batch, culled ones are left out.
+	mBatchVisibleCounts.resize(mInstanceBatches.size());
+	for (size_t b = 0; b < mInstanceBatches.size(); b++)
+	{
+		const InstanceBatch& batch = mInstanceBatches[b];
+		uint32_t visibleCount = 0;
+		for (size_t i = 0; i < batch.renderItems.size(); i++)
+		{
+			uint32_t itemIndex = batch.renderItems[i];
+			if (mItemVisibility[itemIndex])
+				instances[batch.firstInstance + visibleCount++] = mRenderItems[itemIndex].UniformBuffer;
+		}
+		mBatchVisibleCounts[b] = visibleCount;
 	}
+}
 
-	mCurrentImageIndex = (mCurrentImageIndex + 1) % mImageCount;
+void Renderer::WriteObjectData()
+{
+	// Slot i holds render item i, the direct draws pass the item index as their firstInstance.
+	mInstanceRing.BeginFrame(mCurrentFrameIndex);
+	VkDeviceSize offset = 0;
+	SingleObjectUniform* objects = static_cast<SingleObjectUniform*>(
+		mInstanceRing.Allocate(mRenderItems.size() * sizeof(SingleObjectUniform), offset));
+	assert(offset == mInstanceRing.GetFrameOffset(mCurrentFrameIndex));
+
+	for (size_t i = 0; i < mRenderItems.size(); i++)
+		objects[i] = mRenderItems[i].UniformBuffer;
+}
+
+void Renderer::WriteIndirectCommands()
+{
+	mIndirectRing.BeginFrame(mCurrentFrameIndex);
+	VkDeviceSize offset = 0;
+	VkDrawIndexedIndirectCommand* commands = static_cast<VkDrawIndexedIndirectCommand*>(
+		mIndirectRing.Allocate(mRenderItems.size() * sizeof(VkDrawIndexedIndirectCommand), offset));
+	assert(offset == mIndirectRing.GetFrameOffset(mCurrentFrameIndex));
+
+	// One command per visible item, packed at the start of its range. The firstInstance of
+	// a command is the slot WriteInstanceData gave the item's transform.
+	mRangeVisibleCounts.assign(mIndirectRanges.size(), 0);
+	uint32_t rangeIndex = 0;
+	for (size_t b = 0; b < mInstanceBatches.size(); b++)
+	{
+		const InstanceBatch& batch = mInstanceBatches[b];
+		while (batch.firstInstance >= mIndirectRanges[rangeIndex].firstCommand + mIndirectRanges[rangeIndex].commandCount)
+			rangeIndex++;
+
+		const IndirectDrawRange& range = mIndirectRanges[rangeIndex];
+		for (uint32_t i = 0; i < mBatchVisibleCounts[b]; i++)
+		{
+			VkDrawIndexedIndirectCommand& command = commands[range.firstCommand + mRangeVisibleCounts[rangeIndex]++];
+			command.indexCount = batch.indexCount;
+			command.instanceCount = 1;
+			command.firstIndex = batch.firstIndex;
+			command.vertexOffset = static_cast<int32_t>(batch.vertexOffset);
+			command.firstInstance = batch.firstInstance + i;
+		}
+	}
 }
 
 void Renderer::OnKeyUp(int key)
 {
+	if (key == 'M')
+		mAllocator->PrintStats();
+	else if (key == '1')
+	{
+		mDrawPath = DrawPath::Direct;
+		printf("Draw path: direct\n");
+	}
+	else if (key == '2')
+	{
+		mDrawPath = DrawPath::Instanced;
+		printf("Draw path: instanced\n");
+	}
+	else if (key == '3')
+	{
+		if (mDeviceInfo.drawIndirectFirstInstance)
+		{
+			mDrawPath = DrawPath::Indirect;
+			printf("Draw path: indirect\n");
+		}
+		else
+		{
+			printf("Indirect draws need drawIndirectFirstInstance, which this device doesn't support.\n");
+		}
+	}
+	else if (key == '4')
+	{
+		if (mDeviceInfo.drawIndirectFirstInstance)
+		{
+			mDrawPath = DrawPath::GpuCulled;
+			printf("Draw path: GPU culled (%s)\n", mDeviceInfo.drawIndirectCount ? "compacted, draw count" : "zero instance count");
+		}
+		else
+		{
+			printf("Indirect draws need drawIndirectFirstInstance, which this device doesn't support.\n");
+		}
+	}
+	else if (key == 'C')
+	{
+		mCpuCulling = !mCpuCulling;
+		printf("CPU frustum culling: %s\n", mCpuCulling ? "on" : "off");
+	}
+	else if (key == 'P')
+	{
+		if (mObjectDataPath == ObjectDataPath::StorageBuffer)
+		{
+			mObjectDataPath = ObjectDataPath::DynamicUniform;
+			printf("Direct path transforms: dynamic uniform offsets\n");
+		}
+		else if (mObjectDataPath == ObjectDataPath::DynamicUniform)
+		{
+			mObjectDataPath = ObjectDataPath::PushConstant;
+			printf("Direct path transforms: push constants\n");
+		}
+		else
+		{
+			mObjectDataPath = ObjectDataPath::StorageBuffer;
+			printf("Direct path transforms: storage buffer\n");
+		}
+	}
+	else if (key == 'T')
+	{
+		mParallelRecording = !mParallelRecording;
+		printf("Parallel direct recording: %s (%u threads)\n", mParallelRecording ? "on" : "off", mRecordThreads->GetThreadCount());
+	}
+	else if (key == 'R')
+	{
+		mCachedCommandBuffers = !mCachedCommandBuffers;
+		printf("Cached command buffers: %s\n", mCachedCommandBuffers ? "on" : "off");
+	}
+	else if (key == 'H')
+	{
+		ToggleShaderHotReload();
+	}
+	else if (key == 'F')
+	{
+		mWireframe = !mWireframe;
+		printf("Wireframe: %s\n", mWireframe ? "on" : "off");
+	}
+
+	// Every other key changes what gets recorded.
+	if (key != 'M' && key != 'H')
+		InvalidateCommandBuffers();
 }
 
 void Renderer::OnKeyDown(int key)
@@ -734,17 +1453,39 @@ VkDeviceInfo Renderer::CreateLogicalDevice() const
 	queueCreateInfo[1].pNext = nullptr;
 	queueCreateInfo[1].flags = 0;
 
-	createInfo.queueCreateInfoCount = static_cast<uint32_t>(std::size(queueCreateInfo));
+	// A family can only be listed once, without a dedicated transfer family both queues are the same one.
+	createInfo.queueCreateInfoCount = transferQueueIndex != graphicsQueueIndex ? static_cast<uint32_t>(std::size(queueCreateInfo)) : 1u;
 	createInfo.pQueueCreateInfos = queueCreateInfo;
 	VkPhysicalDeviceFeatures features = {};
 	features.depthClamp = VK_TRUE;
 	features.fillModeNonSolid = VK_TRUE;
+	features.multiDrawIndirect = mPhysicalDevice.features.multiDrawIndirect;
+	features.drawIndirectFirstInstance = mPhysicalDevice.features.drawIndirectFirstInstance;
 	createInfo.pEnabledFeatures = &features;
 
+	VkPhysicalDeviceVulkan12Features supportedFeatures12 = {};
+	supportedFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES;
+	VkPhysicalDeviceFeatures2 supportedFeatures = {};
+	supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	supportedFeatures.pNext = &supportedFeatures12;
+	vkGetPhysicalDeviceFeatures2(mPhysicalDevice.physicalDevice, &supportedFeatures);
+
+	if (mPhysicalDevice.properties.apiVersion < VK_API_VERSION_1_2 || !supportedFeatures12.timelineSemaphore)
+		throw std::exception("Timeline semaphores are not supported.");
+
+	VkPhysicalDeviceVulkan12Features features12 = {};
+	features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES;
+	features12.timelineSemaphore = VK_TRUE;
+	features12.drawIndirectCount = supportedFeatures12.drawIndirectCount;
+	createInfo.pNext = &features12;
+
 	VK_CHECK(vkCreateDevice(mPhysicalDevice.physicalDevice, &createInfo, nullptr, &deviceInfo.device));
 
 	deviceInfo.graphicsQueueIndex = graphicsQueueIndex;
 	deviceInfo.transferQueueIndex = transferQueueIndex;
+	deviceInfo.multiDrawIndirect = features.multiDrawIndirect == VK_TRUE;
+	deviceInfo.drawIndirectFirstInstance = features.drawIndirectFirstInstance == VK_TRUE;
+	deviceInfo.drawIndirectCount = features12.drawIndirectCount == VK_TRUE;
 
 	return deviceInfo;
 }
@@ -763,14 +1504,14 @@ VkCommandPool Renderer::CreateCommandPool(uint32_t queueFamilyIndex) const
 	return commandPool;
 }
 
-VkCommandBuffer Renderer::AllocateCommandBuffer(VkCommandPool commandPool) const
+VkCommandBuffer Renderer::AllocateCommandBuffer(VkCommandPool commandPool, VkCommandBufferLevel level) const
 {
 	VkCommandBuffer commandBuffer = nullptr;
 	VkCommandBufferAllocateInfo allocInfo;
 	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 	allocInfo.commandBufferCount = 1;
 	allocInfo.commandPool = commandPool;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.level = level;
 	allocInfo.pNext = nullptr;
 
 	VK_CHECK(vkAllocateCommandBuffers(mDevice, &allocInfo, &commandBuffer));
@@ -778,6 +1519,40 @@ VkCommandBuffer Renderer::AllocateCommandBuffer(VkCommandPool commandPool) const
 	return commandBuffer;
 }
 
+void Renderer::CreateImageCommandBuffers(FrameResources& frameRes) const
+{
+	// Only ever grows. Whatever a slot recorded is idle by the time the slot records again, so the
+	// buffers left over from a swapchain with more images can simply wait here until shutdown.
+	while (frameRes.ImageCommands.size() < mImageCount)
+	{
+		ImageCommandBuffers commands;
+		commands.CommandPool = CreateCommandPool(mDeviceInfo.graphicsQueueIndex);
+		commands.CommandBuffer = AllocateCommandBuffer(commands.CommandPool);
+		for (uint32_t i = 0; i < mRecordThreads->GetThreadCount(); i++)
+		{
+			VkCommandPool commandPool = CreateCommandPool(mDeviceInfo.graphicsQueueIndex);
+			commands.SecondaryCommandPools.push_back(commandPool);
+			commands.SecondaryCommandBuffers.push_back(AllocateCommandBuffer(commandPool, VK_COMMAND_BUFFER_LEVEL_SECONDARY));
+		}
+		frameRes.ImageCommands.push_back(std::move(commands));
+	}
+}
+
+void Renderer::DestroyImageCommandBuffers(FrameResources& frameRes) const
+{
+	for (ImageCommandBuffers& commands : frameRes.ImageCommands)
+	{
+		vkFreeCommandBuffers(mDevice, commands.CommandPool, 1u, &commands.CommandBuffer);
+		vkDestroyCommandPool(mDevice, commands.CommandPool, nullptr);
+		for (size_t i = 0; i < commands.SecondaryCommandPools.size(); i++)
+		{
+			vkFreeCommandBuffers(mDevice, commands.SecondaryCommandPools[i], 1u, &commands.SecondaryCommandBuffers[i]);
+			vkDestroyCommandPool(mDevice, commands.SecondaryCommandPools[i], nullptr);
+		}
+	}
+	frameRes.ImageCommands.clear();
+}
+
 VkSurfaceKHR Renderer::CreateVulkanSurface() const
 {
 	VkSurfaceKHR surface = 0;
@@ -793,7 +1568,7 @@ VkSurfaceKHR Renderer::CreateVulkanSurface() const
 	return surface;
 }
 
-VkSwapchainKHR Renderer::CreateSwapchain(VkSurfaceFormatKHR& out_swapchainSurfaceFormat) const
+VkSwapchainKHR Renderer::CreateSwapchain(VkSurfaceFormatKHR& out_swapchainSurfaceFormat, VkExtent2D& out_swapchainExtent, VkSwapchainKHR oldSwapchain) const
 {
 	VkSwapchainKHR swapchain = 0;
 	VkSwapchainCreateInfoKHR createInfo;
@@ -853,7 +1628,16 @@ VkSwapchainKHR Renderer::CreateSwapchain(VkSurfaceFormatKHR& out_swapchainSurfac
 
 	createInfo.imageFormat = surfaceFormat.format;
 	createInfo.imageColorSpace = surfaceFormat.colorSpace;
-	createInfo.imageExtent = surfaceCapabilities.currentExtent;
+	// A current extent of 0xFFFFFFFF means the surface takes its size from the swapchain.
+	VkExtent2D extent = surfaceCapabilities.currentExtent;
+	if (extent.width == UINT32_MAX)
+	{
+		extent.width = std::clamp(static_cast<uint32_t>(mWindow->GetWindowWidth()), surfaceCapabilities.minImageExtent.width, surfaceCapabilities.maxImageExtent.width);
+		extent.height = std::clamp(static_cast<uint32_t>(mWindow->GetWindowHeight()), surfaceCapabilities.minImageExtent.height, surfaceCapabilities.maxImageExtent.height);
+	}
+	out_swapchainExtent = extent;
+
+	createInfo.imageExtent = extent;
 	createInfo.imageArrayLayers = 1;
 	createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
 	createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
@@ -862,6 +1646,31 @@ VkSwapchainKHR Renderer::CreateSwapchain(VkSurfaceFormatKHR& out_swapchainSurfac
 	createInfo.preTransform = surfaceCapabilities.currentTransform;
 	createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 
+	std::vector<VkPresentModeKHR> presentModes = GetSupportedPresentModes();
+
+	// FIFO is the only mode every surface has to support.
+	VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+
+	for (const VkPresentModeKHR p : presentModes)
+	{
+		if (p == mPresentMode)
+		{
+			presentMode = p;
+			break;
+		}
+	}
+
+	createInfo.presentMode = presentMode;
+	createInfo.clipped = VK_TRUE;
+	createInfo.oldSwapchain = oldSwapchain;
+
+	VK_CHECK(vkCreateSwapchainKHR(mDevice, &createInfo, nullptr, &swapchain));
+
+	return swapchain;
+}
+
+std::vector<VkPresentModeKHR> Renderer::GetSupportedPresentModes() const
+{
 	uint32_t presentModesCount = 0;
 
 	VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(
@@ -880,29 +1689,257 @@ VkSwapchainKHR Renderer::CreateSwapchain(VkSurfaceFormatKHR& out_swapchainSurfac
 		presentModes.data()
 	));
 
-	VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+	return presentModes;
+}
 
-	for (const VkPresentModeKHR p : presentModes)
+void Renderer::RecreateSwapchain()
+{
+	// Frames already submitted still render to the old images. The extra value also covers the present
+	// queued behind the last of them, which waits on the old present semaphore.
+	RetiredSwapchain retired;
+	retired.Swapchain = mSwapchain;
+	retired.ImageViews = std::move(mImageViews);
+	retired.Framebuffers = std::move(mFramebuffers);
+	retired.PresentSemaphores = std::move(mPresentSemaphores);
+	retired.DepthBuffer = mDepthBuffer;
+	retired.TimelineValue = mGraphicsTimelineValue + 1;
+	mRetiredSwapchains.push_back(std::move(retired));
+	mImageViews.clear();
+	mFramebuffers.clear();
+	mPresentSemaphores.clear();
+
+	// Handing the old swapchain over lets the driver reuse its resources instead of starting from scratch.
+	mSwapchain = CreateSwapchain(mSwapchainSurfaceFormat, mSwapchainExtent, mSwapchain);
+	mImageCount = GetSwapchainImagesCount();
+	mImages = GetSwapchainImages(mImageCount);
+	mDepthBuffer = CreateDepthBuffer();
+	CreateSwapchainImageResources();
+	for (FrameResources& frameRes : mFrameResources)
+		CreateImageCommandBuffers(frameRes);
+	UpdateViewportAndScissor();
+
+	// The framebuffers, viewport and scissor are baked into the recorded commands.
+	InvalidateCommandBuffers();
+}
+
+void Renderer::ReleaseRetiredSwapchains(bool releaseAll)
+{
+	while (!mRetiredSwapchains.empty() && (releaseAll || IsGraphicsValueComplete(mRetiredSwapchains.front().TimelineValue)))
 	{
-		if (p == VK_PRESENT_MODE_IMMEDIATE_KHR)
+		RetiredSwapchain& retired = mRetiredSwapchains.front();
+		for (size_t i = 0; i < retired.ImageViews.size(); i++)
 		{
-			presentMode = p;
-			break;
+			vkDestroyFramebuffer(mDevice, retired.Framebuffers[i], nullptr);
+			vkDestroyImageView(mDevice, retired.ImageViews[i], nullptr);
+			vkDestroySemaphore(mDevice, retired.PresentSemaphores[i], nullptr);
 		}
-		else if (p == VK_PRESENT_MODE_MAILBOX_KHR)
+		vkDestroyImageView(mDevice, retired.DepthBuffer.imageView, nullptr);
+		vkDestroyImage(mDevice, retired.DepthBuffer.image, nullptr);
+		mAllocator->Free(retired.DepthBuffer.allocation);
+		vkDestroySwapchainKHR(mDevice, retired.Swapchain, nullptr);
+		mRetiredSwapchains.pop_front();
+	}
+}
+
+void Renderer::ToggleShaderHotReload()
+{
+	if (mShaderWatcher.IsRunning())
+	{
+		mShaderWatcher.Stop();
+		printf("Shader hot reload: off\n");
+		return;
+	}
+
+	if (mShaderWatcher.Start([this](const std::vector<std::string>& spirvPaths) { RebuildPipelines(spirvPaths); }))
+		printf("Shader hot reload: on, watching the GLSL sources\n");
+}
+
+void Renderer::RebuildPipelines(const std::vector<std::string>& spirvPaths)
+{
+	auto changed = [&spirvPaths](const char* spirvPath)
+	{
+		return std::find(spirvPaths.begin(), spirvPaths.end(), spirvPath) != spirvPaths.end();
+	};
+
+	for (const std::string& spirvPath : spirvPaths)
+		mShaderCache.InvalidatePath(spirvPath.c_str());
+
+	const struct
+	{
+		GraphicsPipelineDesc* target;
+		ObjectDataPath objectData;
+	} graphicsPipelines[] = {
+		{ &mGraphicsPipelineDesc, ObjectDataPath::DynamicUniform },
+		{ &mPushConstantPipelineDesc, ObjectDataPath::PushConstant },
+		{ &mInstancedPipelineDesc, ObjectDataPath::StorageBuffer },
+	};
+	// Every scene pipeline is a specialization of the same two shaders.
+	bool sceneShadersChanged = changed("./Shaders/vert.spv") || changed("./Shaders/frag.spv");
+
+	// Everything below only reads state that is fixed after startup, and the pipeline cache is
+	// internally synchronized, so the render thread keeps going while this compiles.
+	std::vector<ReloadedPipelineDesc> reloadedDescs;
+	std::vector<ReloadedPipeline> rebuilt;
+	try
+	{
+		// The registry compiles these on its own thread, queueing them here gives it a head start.
+		for (const auto& graphicsPipeline : graphicsPipelines)
 		{
-			presentMode = p;
+			if (sceneShadersChanged)
+			{
+				reloadedDescs.push_back({ graphicsPipeline.target, MakeGraphicsPipelineDesc(graphicsPipeline.objectData) });
+				mPipelineRegistry.Request(reloadedDescs.back().Desc);
+			}
 		}
+		if (changed("./Shaders/cull.spv"))
+			rebuilt.push_back({ &mCullPipeline, CreateComputePipeline("./Shaders/cull.spv", mCullPipelineLayout) });
+	}
+	catch (const std::exception& e)
+	{
+		printf("Pipeline rebuild failed, keeping the current pipelines: %s\n", e.what());
+		for (ReloadedPipeline& reloaded : rebuilt)
+			vkDestroyPipeline(mDevice, reloaded.Pipeline, nullptr);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mReloadMutex);
+	mReloadedPipelineDescs.insert(mReloadedPipelineDescs.end(), reloadedDescs.begin(), reloadedDescs.end());
+	mReloadedPipelines.insert(mReloadedPipelines.end(), rebuilt.begin(), rebuilt.end());
+}
 
+void Renderer::ApplyReloadedPipelines()
+{
+	std::vector<ReloadedPipeline> reloadedPipelines;
+	std::vector<ReloadedPipelineDesc> reloadedDescs;
+	{
+		std::lock_guard<std::mutex> lock(mReloadMutex);
+		if (mReloadedPipelines.empty() && mReloadedPipelineDescs.empty())
+			return;
+		reloadedPipelines.swap(mReloadedPipelines);
+		reloadedDescs.swap(mReloadedPipelineDescs);
 	}
 
-	createInfo.presentMode = VK_PRESENT_MODE_FIFO_KHR;
-	createInfo.clipped = VK_TRUE;
-	createInfo.oldSwapchain = 0;
+	// The pipelines built from the old descs stay in the registry, switching back costs nothing.
+	for (ReloadedPipelineDesc& reloaded : reloadedDescs)
+		*reloaded.Target = reloaded.Desc;
 
-	VK_CHECK(vkCreateSwapchainKHR(mDevice, &createInfo, nullptr, &swapchain));
+	// Everything submitted so far may still use the old pipelines, the frame about to be recorded won't.
+	for (ReloadedPipeline& reloaded : reloadedPipelines)
+	{
+		mRetiredPipelines.push_back({ *reloaded.Target, mGraphicsTimelineValue });
+		*reloaded.Target = reloaded.Pipeline;
+	}
 
-	return swapchain;
+	InvalidateCommandBuffers();
+}
+
+void Renderer::ResolveGraphicsPipelines()
+{
+	const struct
+	{
+		VkPipeline* target;
+		const GraphicsPipelineDesc* desc;
+	} graphicsPipelines[] = {
+		{ &mGraphicsPipeline, &mGraphicsPipelineDesc },
+		{ &mPushConstantPipeline, &mPushConstantPipelineDesc },
+		{ &mInstancedPipeline, &mInstancedPipelineDesc },
+	};
+
+	bool changed = false;
+	for (const auto& graphicsPipeline : graphicsPipelines)
+	{
+		GraphicsPipelineDesc desc = *graphicsPipeline.desc;
+		desc.PolygonMode = mWireframe ? VK_POLYGON_MODE_LINE : VK_POLYGON_MODE_FILL;
+
+		// Whatever is bound now keeps drawing until the requested variant is compiled.
+		VkPipeline pipeline = mPipelineRegistry.Get(desc, *graphicsPipeline.target);
+		if (pipeline != *graphicsPipeline.target)
+		{
+			*graphicsPipeline.target = pipeline;
+			changed = true;
+		}
+	}
+
+	if (changed)
+		InvalidateCommandBuffers();
+}
+
+GraphicsPipelineDesc Renderer::MakeGraphicsPipelineDesc(ObjectDataPath objectData)
+{
+	GraphicsPipelineDesc desc;
+	desc.VertexShader = CreateShaderModule("./Shaders/vert.spv");
+	desc.FragmentShader = CreateShaderModule("./Shaders/frag.spv");
+	desc.ObjectData = objectData;
+	desc.VertexInput = meshVertexLayout;
+	desc.PolygonMode = VK_POLYGON_MODE_FILL;
+	desc.CullMode = VK_CULL_MODE_BACK_BIT;
+	desc.DepthTest = VK_TRUE;
+	desc.DepthWrite = VK_TRUE;
+	desc.BlendEnable = VK_TRUE;
+	desc.RenderPass = mRenderpass;
+	desc.Subpass = 0;
+
+	return desc;
+}
+
+void Renderer::ReleaseRetiredPipelines(bool releaseAll)
+{
+	while (!mRetiredPipelines.empty() && (releaseAll || IsGraphicsValueComplete(mRetiredPipelines.front().TimelineValue)))
+	{
+		vkDestroyPipeline(mDevice, mRetiredPipelines.front().Pipeline, nullptr);
+		mRetiredPipelines.pop_front();
+	}
+}
+
+void Renderer::ToggleVSync()
+{
+	if (!this) return;
+
+	const VkPresentModeKHR cycle[] = {
+		VK_PRESENT_MODE_FIFO_KHR,
+		VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+		VK_PRESENT_MODE_MAILBOX_KHR,
+		VK_PRESENT_MODE_IMMEDIATE_KHR
+	};
+
+	size_t current = 0;
+	while (current < std::size(cycle) && cycle[current] != mPresentMode)
+		current++;
+
+	// Next mode in the cycle the surface supports, FIFO always is so this ends at the latest when it wraps around.
+	VkPresentModeKHR nextMode = mPresentMode;
+	for (size_t i = 1; i <= std::size(cycle); i++)
+	{
+		VkPresentModeKHR candidate = cycle[(current + i) % std::size(cycle)];
+		if (std::find(mSupportedPresentModes.begin(), mSupportedPresentModes.end(), candidate) != mSupportedPresentModes.end())
+		{
+			nextMode = candidate;
+			break;
+		}
+	}
+
+	if (mPresentModeStats.frameCount > 0)
+	{
+		printf("Present mode %s: %u frames, CPU frame time %.3f ms, acquire wait %.3f ms\n",
+			GetPresentModeName(mPresentMode),
+			mPresentModeStats.frameCount,
+			mPresentModeStats.frameTime * 1000.0 / mPresentModeStats.frameCount,
+			mPresentModeStats.acquireTime * 1000.0 / mPresentModeStats.frameCount);
+	}
+
+	if (nextMode == mPresentMode)
+	{
+		printf("No other present mode is supported by this surface.\n");
+		return;
+	}
+
+	mPresentMode = nextMode;
+	RecreateSwapchain();
+	printf("Present mode: %s\n", GetPresentModeName(mPresentMode));
+
+	// Start measuring the new mode from here, the recreate itself shouldn't count as a frame.
+	mPresentModeStats = {};
+	mTimer.GetDelta();
 }
 
 uint32_t Renderer::GetSwapchainImagesCount() const
@@ -935,8 +1972,8 @@ Image Renderer::CreateDepthBuffer() const
 	createInfo.imageType = VK_IMAGE_TYPE_2D;
 	createInfo.format = VK_FORMAT_D32_SFLOAT;
 	createInfo.extent.depth = 1;
-	createInfo.extent.width = (uint32_t)mWindow->GetWindowWidth();
-	createInfo.extent.height = (uint32_t)mWindow->GetWindowHeight();
+	createInfo.extent.width = mSwapchainExtent.width;
+	createInfo.extent.height = mSwapchainExtent.height;
 	createInfo.mipLevels = 1;
 	createInfo.arrayLayers = 1;
 	createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -954,16 +1991,8 @@ Image Renderer::CreateDepthBuffer() const
 
 	uint32_t memIndex = FindMemoryIndex(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
-	VkMemoryAllocateInfo allocateInfo;
-	allocateInfo.allocationSize = requirements.size;
-	allocateInfo.memoryTypeIndex = memIndex;
-	allocateInfo.pNext = nullptr;
-	allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-
-	VkDeviceMemory memory = nullptr;
-
-	VK_CHECK(vkAllocateMemory(mDevice, &allocateInfo, nullptr, &memory));
-	VK_CHECK(vkBindImageMemory(mDevice, image, memory, 0));
+	Allocation allocation = mAllocator->Allocate(requirements, memIndex, false);
+	VK_CHECK(vkBindImageMemory(mDevice, image, allocation.memory, allocation.offset));
 
 	VkImageViewCreateInfo vCreateInfo;
 	vCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -986,7 +2015,7 @@ Image Renderer::CreateDepthBuffer() const
 
 	VK_CHECK(vkCreateImageView(mDevice, &vCreateInfo, nullptr, &view));
 
-	return { image, memory, view };
+	return { image, allocation, view };
 }
 
 VkImageView Renderer::CreateImageView(VkFormat viewFormat, VkImage image, VkImageAspectFlags imageAspect) const
@@ -1014,59 +2043,9 @@ VkImageView Renderer::CreateImageView(VkFormat viewFormat, VkImage image, VkImag
 	return imageView;
 }
 
-VkShaderModule Renderer::CreateShaderModule(const char* shaderPath) const
+VkShaderModule Renderer::CreateShaderModule(const char* shaderPath)
 {
-	HANDLE shaderHandle = CreateFileA(shaderPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_READONLY, NULL);
-
-	DWORD err = GetLastError();
-
-	if (err)
-	{
-		throw std::exception("Failed to load Shader");
-	}
-
-	LPSTR errMessage = 0;
-
-	FormatMessageA(
-		FORMAT_MESSAGE_ALLOCATE_BUFFER | 
-		FORMAT_MESSAGE_FROM_SYSTEM | 
-		FORMAT_MESSAGE_IGNORE_INSERTS, 
-		NULL, 
-		err, 
-		MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), 
-		(LPSTR)&errMessage, 
-		0, 
-		nullptr
-	);
-
-	std::cout << errMessage << std::endl;
-
-	char* shaderCode = (char*)malloc(shaderCodeMaxSize);
-	ZeroMemory(shaderCode, shaderCodeMaxSize);
-	DWORD shaderSize = 0;
-
-	BOOL wasRead = ReadFile(shaderHandle, shaderCode, shaderCodeMaxSize, &shaderSize, nullptr);
-
-	if (!wasRead)
-	{
-		throw std::exception("Failed to read Shader code");
-	}
-
-	VkShaderModule shaderModule = 0;
-
-	VkShaderModuleCreateInfo createInfo;
-	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-	createInfo.pNext = nullptr;
-	createInfo.codeSize = static_cast<size_t>(shaderSize);
-	createInfo.flags = 0;
-	createInfo.pCode = reinterpret_cast<const uint32_t*>(shaderCode);
-
-	VK_CHECK(vkCreateShaderModule(mDevice, &createInfo, nullptr, &shaderModule));
-
-	free(shaderCode);
-	shaderCode = 0;
-
-	return shaderModule;
+	return mShaderCache.GetModule(shaderPath);
 }
 
 VkRenderPass Renderer::CreateRenderPass() const
@@ -1140,6 +2119,32 @@ VkRenderPass Renderer::CreateRenderPass() const
 	return renderPass;
 }
 
+void Renderer::CreateSwapchainImageResources()
+{
+	for (VkImage image : mImages)
+	{
+		VkImageView imgView = CreateImageView(mSwapchainSurfaceFormat.format, image, VK_IMAGE_ASPECT_COLOR_BIT);
+		mImageViews.push_back(imgView);
+
+		VkImageView imgViews[] = { imgView, mDepthBuffer.imageView };
+		mFramebuffers.push_back(CreateFramebuffer(mRenderpass, 2, imgViews, mSwapchainExtent.width, mSwapchainExtent.height));
+		mPresentSemaphores.push_back(CreateSemaphore());
+	}
+}
+
+void Renderer::DestroySwapchainImageResources()
+{
+	for (size_t i = 0; i < mImageViews.size(); i++)
+	{
+		vkDestroyFramebuffer(mDevice, mFramebuffers[i], nullptr);
+		vkDestroyImageView(mDevice, mImageViews[i], nullptr);
+		vkDestroySemaphore(mDevice, mPresentSemaphores[i], nullptr);
+	}
+	mImageViews.clear();
+	mFramebuffers.clear();
+	mPresentSemaphores.clear();
+}
+
 VkFramebuffer Renderer::CreateFramebuffer(VkRenderPass renderpass, uint32_t numImageViews, VkImageView* imageViews, uint32_t width, uint32_t height) const
 {
 	VkFramebuffer framebuffer = nullptr;
@@ -1181,22 +2186,17 @@ Buffer Renderer::CreateGlobalUniformBuffer(uint32_t numFrames) const
 	uint32_t memIndex = FindMemoryIndex(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
 		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-	VkMemoryAllocateInfo allocateInfo;
-	allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocateInfo.pNext = nullptr;
-	allocateInfo.allocationSize = requirements.size;
-	allocateInfo.memoryTypeIndex = memIndex;
 
-	VK_CHECK(vkAllocateMemory(mDevice, &allocateInfo, nullptr, &buffer.memory));
+	buffer.allocation = mAllocator->Allocate(requirements, memIndex, true);
 
 	return buffer;
 }
 
-VkDescriptorSetLayout Renderer::CreateDescriptorSetLayout() const
+VkDescriptorSetLayout Renderer::CreateDescriptorSetLayout(VkDescriptorType descriptorType) const
 {
 	VkDescriptorSetLayoutBinding descSetLayoutBinding[1];
 	descSetLayoutBinding[0].binding = 0;
-	descSetLayoutBinding[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	descSetLayoutBinding[0].descriptorType = descriptorType;
 	descSetLayoutBinding[0].descriptorCount = 1;
 	descSetLayoutBinding[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 	descSetLayoutBinding[0].pImmutableSamplers = nullptr;
@@ -1218,17 +2218,22 @@ VkDescriptorSetLayout Renderer::CreateDescriptorSetLayout() const
 VkDescriptorPool Renderer::CreateDescriptorPool() const
 {
 	VkDescriptorPoolCreateInfo createInfo;
-	VkDescriptorPoolSize size;
-	size.descriptorCount = 1000;
-	size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	// A handful of sets per frame, none of them per render item.
+	VkDescriptorPoolSize sizes[3];
+	sizes[0].descriptorCount = 64;
+	sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	sizes[1].descriptorCount = 64;
+	sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	sizes[2].descriptorCount = 16;
+	sizes[2].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	VkDescriptorPool descriptorPool = nullptr;
 
 	createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	createInfo.pNext = nullptr;
 	createInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
-	createInfo.poolSizeCount = 1;
-	createInfo.pPoolSizes = &size;
-	createInfo.maxSets = 1000;
+	createInfo.poolSizeCount = static_cast<uint32_t>(std::size(sizes));
+	createInfo.pPoolSizes = sizes;
+	createInfo.maxSets = 64;
 	
 	VK_CHECK(vkCreateDescriptorPool(mDevice, &createInfo, nullptr, &descriptorPool));
 	
@@ -1237,14 +2242,14 @@ VkDescriptorPool Renderer::CreateDescriptorPool() const
 
 std::vector<VkDescriptorSet> Renderer::AllocateGlobalDescriptorSets() const
 {
-	std::vector<VkDescriptorSet> descriptorSets(mImageCount);
+	std::vector<VkDescriptorSet> descriptorSets(framesInFlight);
 	VkDescriptorSetAllocateInfo allocateInfo;
 	allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	allocateInfo.pNext = nullptr;
 	allocateInfo.descriptorPool = mGlobalDescriptorPool;
-	allocateInfo.descriptorSetCount = mImageCount;
+	allocateInfo.descriptorSetCount = framesInFlight;
 	std::vector<VkDescriptorSetLayout> layouts;
-	for (uint32_t i = 0; i < mImageCount; i++)
+	for (uint32_t i = 0; i < framesInFlight; i++)
 	{
 		layouts.push_back(mGlobalDescriptorSetLayout);
 	}
@@ -1254,22 +2259,34 @@ std::vector<VkDescriptorSet> Renderer::AllocateGlobalDescriptorSets() const
 	return descriptorSets;
 }
 
-void Renderer::UpdateUniformBuffer(Buffer buffer, uint64_t bufferStride, uint64_t offset, void* data) const
-{
-	bufferStride = CalculateUniformBufferSize(bufferStride);
-	//printf("Updating index %I64u\n", offset);
-	void* mapped = nullptr;
-	VK_CHECK(vkMapMemory(mDevice, buffer.memory, offset * bufferStride, bufferStride, 0, &mapped));
-	memcpy(mapped, data, bufferStride);
-	vkUnmapMemory(mDevice, buffer.memory);
+void Renderer::UpdateDescriptorSet(Buffer buffer, uint64_t bufferStride, VkDescriptorSet descriptorSet, uint64_t offset, uint32_t binding, VkDescriptorType descriptorType) const
+{
+	VkDescriptorBufferInfo binfo;
+	binfo.buffer = buffer.buffer;
+	binfo.range = CalculateUniformBufferSize(bufferStride);
+	binfo.offset = offset * CalculateUniformBufferSize(bufferStride);
+
+	VkWriteDescriptorSet write;
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.pNext = nullptr;
+	write.dstSet = descriptorSet;
+	write.dstBinding = binding;
+	write.dstArrayElement = 0;
+	write.descriptorCount = 1;
+	write.descriptorType = descriptorType;
+	write.pImageInfo = nullptr;
+	write.pBufferInfo = &binfo;
+	write.pTexelBufferView = nullptr;
+
+	vkUpdateDescriptorSets(mDevice, 1, &write, 0, nullptr);
 }
 
-void Renderer::UpdateDescriptorSet(Buffer buffer, uint64_t bufferStride, VkDescriptorSet descriptorSet, uint64_t offset, uint32_t binding) const
+void Renderer::UpdateStorageDescriptorSet(Buffer buffer, VkDescriptorSet descriptorSet, VkDeviceSize offset, VkDeviceSize range, uint32_t binding) const
 {
 	VkDescriptorBufferInfo binfo;
 	binfo.buffer = buffer.buffer;
-	binfo.range = CalculateUniformBufferSize(bufferStride);
-	binfo.offset = offset * CalculateUniformBufferSize(bufferStride);
+	binfo.range = range;
+	binfo.offset = offset;
 
 	VkWriteDescriptorSet write;
 	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -1278,7 +2295,7 @@ void Renderer::UpdateDescriptorSet(Buffer buffer, uint64_t bufferStride, VkDescr
 	write.dstBinding = binding;
 	write.dstArrayElement = 0;
 	write.descriptorCount = 1;
-	write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	write.pImageInfo = nullptr;
 	write.pBufferInfo = &binfo;
 	write.pTexelBufferView = nullptr;
@@ -1297,12 +2314,19 @@ VkPipelineLayout Renderer::CreatePipelineLayout() const
 	VkDescriptorSetLayout layouts[] =
 	{
 		mGlobalDescriptorSetLayout,
-		mGlobalDescriptorSetLayout
+		mObjectDescriptorSetLayout,
+		mInstanceDescriptorSetLayout
 	};
 	pipeLayoutCreateInfo.setLayoutCount = static_cast<uint32_t>(std::size(layouts));
 	pipeLayoutCreateInfo.pSetLayouts = layouts;
-	pipeLayoutCreateInfo.pushConstantRangeCount = 0;
-	pipeLayoutCreateInfo.pPushConstantRanges = nullptr;
+
+	// 64 bytes, well below the 128 every device guarantees.
+	VkPushConstantRange pushConstantRange;
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(ObjectPushConstants);
+	pipeLayoutCreateInfo.pushConstantRangeCount = 1;
+	pipeLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
 
 	VkPipelineLayout pipelineLayout = nullptr;
 
@@ -1316,7 +2340,7 @@ VkPipelineLayout Renderer::CreatePipelineLayout() const
 	return pipelineLayout;
 }
 
-VkPipeline Renderer::CreateVulkanPipeline() const
+VkPipeline Renderer::CreateVulkanPipeline(const GraphicsPipelineDesc& desc) const
 {
 	VkPipeline pipeline = 0;
 	VkGraphicsPipelineCreateInfo createInfo;
@@ -1332,8 +2356,30 @@ VkPipeline Renderer::CreateVulkanPipeline() const
 	VkPipelineShaderStageCreateInfo stages[2];
 	
 	// Vertex Shader
-	VkShaderModule vertexShader = CreateShaderModule("./Shaders/vert.spv");
-	VkShaderModule fragShader = CreateShaderModule("./Shaders/frag.spv");
+	VkShaderModule vertexShader = desc.VertexShader;
+	VkShaderModule fragShader = desc.FragmentShader;
+
+	// Specialization, the constant ids match vertex.vert and fragment.frag. Both stages get the
+	// same entries, an id a shader doesn't declare is ignored.
+	struct SpecializationData
+	{
+		int32_t objectDataSource;
+		VkBool32 wireframe;
+	} specializationData;
+	specializationData.objectDataSource = static_cast<int32_t>(desc.ObjectData);
+	specializationData.wireframe = desc.PolygonMode == VK_POLYGON_MODE_LINE ? VK_TRUE : VK_FALSE;
+
+	const VkSpecializationMapEntry specializationEntries[] =
+	{
+		{ 0, offsetof(SpecializationData, objectDataSource), sizeof(int32_t) },
+		{ 1, offsetof(SpecializationData, wireframe), sizeof(VkBool32) }
+	};
+
+	VkSpecializationInfo specializationInfo;
+	specializationInfo.mapEntryCount = static_cast<uint32_t>(std::size(specializationEntries));
+	specializationInfo.pMapEntries = specializationEntries;
+	specializationInfo.dataSize = sizeof(specializationData);
+	specializationInfo.pData = &specializationData;
 
 	stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	stages[0].pNext = nullptr;
@@ -1341,7 +2387,7 @@ VkPipeline Renderer::CreateVulkanPipeline() const
 	stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
 	stages[0].module = vertexShader;
 	stages[0].pName = "main";
-	stages[0].pSpecializationInfo = nullptr;
+	stages[0].pSpecializationInfo = &specializationInfo;
 	
 	// Pixel Shader
 	stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -1350,7 +2396,7 @@ VkPipeline Renderer::CreateVulkanPipeline() const
 	stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
 	stages[1].module = fragShader;
 	stages[1].pName = "main";
-	stages[1].pSpecializationInfo = nullptr;
+	stages[1].pSpecializationInfo = &specializationInfo;
 
 	createInfo.stageCount = static_cast<uint32_t>(std::size(stages));
 	createInfo.pStages = stages;
@@ -1371,41 +2417,69 @@ VkPipeline Renderer::CreateVulkanPipeline() const
 	vertexInputState.pVertexBindingDescriptions = vertBindings;
 
 	VkVertexInputAttributeDescription vertAttributes[5];
-	// x,y,z
-	vertAttributes[0].binding = 0;
-	vertAttributes[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-	vertAttributes[0].location = 0;
-	vertAttributes[0].offset = 0;
-
-	// normal
-	vertAttributes[1].binding = 0;
-	vertAttributes[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-	vertAttributes[1].location = 1;
-	vertAttributes[1].offset = sizeof(GeometryGenerator::Vertex::Position);
-
-	// tangentU
-	vertAttributes[2].binding = 0;
-	vertAttributes[2].format = VK_FORMAT_R32G32B32_SFLOAT;
-	vertAttributes[2].location = 2;
-	vertAttributes[2].offset = sizeof(GeometryGenerator::Vertex::Position) +
-							   sizeof(GeometryGenerator::Vertex::Normal);
-
-	// TexC
-	vertAttributes[3].binding = 0;
-	vertAttributes[3].format = VK_FORMAT_R32G32_SFLOAT;
-	vertAttributes[3].location = 3;
-	vertAttributes[3].offset = sizeof(GeometryGenerator::Vertex::Position) +
-							   sizeof(GeometryGenerator::Vertex::Normal) + 
-							   sizeof(GeometryGenerator::Vertex::TangentU);
-
-	// color
-	vertAttributes[4].binding = 0;
-	vertAttributes[4].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-	vertAttributes[4].location = 4;
-	vertAttributes[4].offset = sizeof(GeometryGenerator::Vertex::Position) +
-		sizeof(GeometryGenerator::Vertex::Normal) +
-		sizeof(GeometryGenerator::Vertex::TangentU) +
-		sizeof(GeometryGenerator::Vertex::TexC);
+	if (desc.VertexInput == VertexLayout::Packed)
+	{
+		// Same locations as the unpacked layout, the fixed function fetch expands every format back to floats.
+		vertBindings[0].stride = sizeof(PackedVertex);
+
+		const struct
+		{
+			VkFormat format;
+			uint32_t offset;
+		} packedAttributes[] = {
+			{ VK_FORMAT_R32G32B32_SFLOAT, offsetof(PackedVertex, Position) },
+			{ VK_FORMAT_R16G16_SNORM, offsetof(PackedVertex, Normal) },
+			{ VK_FORMAT_R16G16_SNORM, offsetof(PackedVertex, TangentU) },
+			{ VK_FORMAT_R16G16_SFLOAT, offsetof(PackedVertex, TexC) },
+			{ VK_FORMAT_R8G8B8A8_UNORM, offsetof(PackedVertex, Color) },
+		};
+
+		for (uint32_t i = 0; i < std::size(vertAttributes); i++)
+		{
+			vertAttributes[i].binding = 0;
+			vertAttributes[i].format = packedAttributes[i].format;
+			vertAttributes[i].location = i;
+			vertAttributes[i].offset = packedAttributes[i].offset;
+		}
+	}
+	else
+	{
+		// x,y,z
+		vertAttributes[0].binding = 0;
+		vertAttributes[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+		vertAttributes[0].location = 0;
+		vertAttributes[0].offset = 0;
+
+		// normal
+		vertAttributes[1].binding = 0;
+		vertAttributes[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+		vertAttributes[1].location = 1;
+		vertAttributes[1].offset = sizeof(GeometryGenerator::Vertex::Position);
+
+		// tangentU
+		vertAttributes[2].binding = 0;
+		vertAttributes[2].format = VK_FORMAT_R32G32B32_SFLOAT;
+		vertAttributes[2].location = 2;
+		vertAttributes[2].offset = sizeof(GeometryGenerator::Vertex::Position) +
+								   sizeof(GeometryGenerator::Vertex::Normal);
+
+		// TexC
+		vertAttributes[3].binding = 0;
+		vertAttributes[3].format = VK_FORMAT_R32G32_SFLOAT;
+		vertAttributes[3].location = 3;
+		vertAttributes[3].offset = sizeof(GeometryGenerator::Vertex::Position) +
+								   sizeof(GeometryGenerator::Vertex::Normal) + 
+								   sizeof(GeometryGenerator::Vertex::TangentU);
+
+		// color
+		vertAttributes[4].binding = 0;
+		vertAttributes[4].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		vertAttributes[4].location = 4;
+		vertAttributes[4].offset = sizeof(GeometryGenerator::Vertex::Position) +
+			sizeof(GeometryGenerator::Vertex::Normal) +
+			sizeof(GeometryGenerator::Vertex::TangentU) +
+			sizeof(GeometryGenerator::Vertex::TexC);
+	}
 
 	vertexInputState.vertexAttributeDescriptionCount = static_cast<uint32_t>(std::size(vertAttributes));
 	vertexInputState.pVertexAttributeDescriptions = vertAttributes;
@@ -1436,8 +2510,9 @@ VkPipeline Renderer::CreateVulkanPipeline() const
 	vpStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	vpStateCreateInfo.pNext = nullptr;
 	vpStateCreateInfo.flags = 0;
-	vpStateCreateInfo.pViewports = &mViewport;
-	vpStateCreateInfo.pScissors = &mScissor;
+	// Both are dynamic state, leaving them out also keeps hot reload builds from reading them while a resize writes them.
+	vpStateCreateInfo.pViewports = nullptr;
+	vpStateCreateInfo.pScissors = nullptr;
 	vpStateCreateInfo.scissorCount = vpStateCreateInfo.viewportCount = 1;
 
 	createInfo.pViewportState = &vpStateCreateInfo;
@@ -1449,8 +2524,8 @@ VkPipeline Renderer::CreateVulkanPipeline() const
 	rsCreateInfo.flags = 0;
 	rsCreateInfo.depthClampEnable = VK_TRUE;
 	rsCreateInfo.rasterizerDiscardEnable = VK_FALSE;
-	rsCreateInfo.polygonMode = VK_POLYGON_MODE_FILL;
-	rsCreateInfo.cullMode = VK_CULL_MODE_BACK_BIT;
+	rsCreateInfo.polygonMode = desc.PolygonMode;
+	rsCreateInfo.cullMode = desc.CullMode;
 	rsCreateInfo.frontFace = VK_FRONT_FACE_CLOCKWISE;
 	rsCreateInfo.depthBiasEnable = VK_FALSE;
 	rsCreateInfo.depthBiasConstantFactor = 0.0f;
@@ -1479,8 +2554,8 @@ VkPipeline Renderer::CreateVulkanPipeline() const
 	dsCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
 	dsCreateInfo.pNext = nullptr;
 	dsCreateInfo.flags = 0;
-	dsCreateInfo.depthTestEnable = VK_TRUE;
-	dsCreateInfo.depthWriteEnable = VK_TRUE;
+	dsCreateInfo.depthTestEnable = desc.DepthTest;
+	dsCreateInfo.depthWriteEnable = desc.DepthWrite;
 	dsCreateInfo.depthCompareOp = VK_COMPARE_OP_LESS;
 	dsCreateInfo.depthBoundsTestEnable = VK_FALSE;
 	dsCreateInfo.stencilTestEnable = VK_FALSE;
@@ -1493,7 +2568,7 @@ VkPipeline Renderer::CreateVulkanPipeline() const
 
 	// ColorBlend
 	VkPipelineColorBlendAttachmentState cbAttachments[1];
-	cbAttachments[0].blendEnable = VK_TRUE;
+	cbAttachments[0].blendEnable = desc.BlendEnable;
 	cbAttachments[0].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
 	cbAttachments[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
 	cbAttachments[0].colorBlendOp = VK_BLEND_OP_ADD;
@@ -1535,42 +2610,109 @@ VkPipeline Renderer::CreateVulkanPipeline() const
 
 	createInfo.layout = mPipelineLayout;
 
-	createInfo.renderPass = mRenderpass;
-	createInfo.subpass = 0;
+	createInfo.renderPass = desc.RenderPass;
+	createInfo.subpass = desc.Subpass;
 	createInfo.basePipelineHandle = nullptr;
 	createInfo.basePipelineIndex = 0;
 
 	VK_CHECK(vkCreateGraphicsPipelines(
 		mDevice,
-		nullptr,
+		mPipelineCache.GetHandle(),
 		1u,
 		&createInfo,
 		nullptr,
 		&pipeline
 	));
 
-	vkDestroyShaderModule(mDevice, vertexShader, nullptr);
-	vkDestroyShaderModule(mDevice, fragShader, nullptr);
-
 	return pipeline;
 }
 
-VkFence Renderer::CreateVulkanFence() const
+VkDescriptorSetLayout Renderer::CreateCullDescriptorSetLayout() const
+{
+	// Global uniform, instances, cull items, draw commands and draw counts.
+	VkDescriptorSetLayoutBinding descSetLayoutBinding[5];
+	for (uint32_t i = 0; i < static_cast<uint32_t>(std::size(descSetLayoutBinding)); i++)
+	{
+		descSetLayoutBinding[i].binding = i;
+		descSetLayoutBinding[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		descSetLayoutBinding[i].descriptorCount = 1;
+		descSetLayoutBinding[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		descSetLayoutBinding[i].pImmutableSamplers = nullptr;
+	}
+
+	VkDescriptorSetLayoutCreateInfo descSetLayoutCreateInfo;
+	descSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	descSetLayoutCreateInfo.pNext = nullptr;
+	descSetLayoutCreateInfo.flags = 0;
+	descSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(std::size(descSetLayoutBinding));
+	descSetLayoutCreateInfo.pBindings = descSetLayoutBinding;
+
+	VkDescriptorSetLayout descSetLayout = nullptr;
+
+	VK_CHECK(vkCreateDescriptorSetLayout(mDevice, &descSetLayoutCreateInfo, nullptr, &descSetLayout));
+
+	return descSetLayout;
+}
+
+VkPipelineLayout Renderer::CreateCullPipelineLayout() const
+{
+	VkPushConstantRange pushConstantRange;
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(CullParams);
+
+	VkPipelineLayoutCreateInfo pipeLayoutCreateInfo;
+	pipeLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipeLayoutCreateInfo.pNext = nullptr;
+	pipeLayoutCreateInfo.flags = 0;
+	pipeLayoutCreateInfo.setLayoutCount = 1;
+	pipeLayoutCreateInfo.pSetLayouts = &mCullDescriptorSetLayout;
+	pipeLayoutCreateInfo.pushConstantRangeCount = 1;
+	pipeLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+
+	VkPipelineLayout pipelineLayout = nullptr;
+
+	VK_CHECK(vkCreatePipelineLayout(
+		mDevice,
+		&pipeLayoutCreateInfo,
+		nullptr,
+		&pipelineLayout
+	));
+
+	return pipelineLayout;
+}
+
+VkPipeline Renderer::CreateComputePipeline(const char* shaderPath, VkPipelineLayout pipelineLayout)
 {
-	VkFence fence = nullptr;
-	VkFenceCreateInfo createInfo;
-	createInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	VkShaderModule computeShader = CreateShaderModule(shaderPath);
+
+	VkComputePipelineCreateInfo createInfo;
+	createInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
 	createInfo.pNext = nullptr;
-	createInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+	createInfo.flags = 0;
+	createInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	createInfo.stage.pNext = nullptr;
+	createInfo.stage.flags = 0;
+	createInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	createInfo.stage.module = computeShader;
+	createInfo.stage.pName = "main";
+	createInfo.stage.pSpecializationInfo = nullptr;
+	createInfo.layout = pipelineLayout;
+	createInfo.basePipelineHandle = nullptr;
+	createInfo.basePipelineIndex = 0;
+
+	VkPipeline pipeline = nullptr;
 
-	VK_CHECK(vkCreateFence(
+	VK_CHECK(vkCreateComputePipelines(
 		mDevice,
+		mPipelineCache.GetHandle(),
+		1u,
 		&createInfo,
 		nullptr,
-		&fence
+		&pipeline
 	));
 
-	return fence;
+	return pipeline;
 }
 
 VkSemaphore Renderer::CreateSemaphore() const
@@ -1590,6 +2732,29 @@ VkSemaphore Renderer::CreateSemaphore() const
 	return semaphore;
 }
 
+VkSemaphore Renderer::CreateTimelineSemaphore(uint64_t initialValue) const
+{
+	VkSemaphoreTypeCreateInfo typeInfo;
+	typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	typeInfo.pNext = nullptr;
+	typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	typeInfo.initialValue = initialValue;
+
+	VkSemaphore semaphore = nullptr;
+	VkSemaphoreCreateInfo createInfo;
+	createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	createInfo.pNext = &typeInfo;
+	createInfo.flags = 0;
+	VK_CHECK(vkCreateSemaphore(
+		mDevice,
+		&createInfo,
+		nullptr,
+		&semaphore
+	));
+
+	return semaphore;
+}
+
 int32_t Renderer::FindMemoryIndex(uint32_t memoryTypeBits, VkMemoryPropertyFlags requestedMemoryType) const
 {
 	for (uint32_t i = 0; i < mPhysicalDevice.memoryProperties.memoryTypeCount; i++)
@@ -1635,18 +2800,7 @@ Buffer Renderer::CreateBuffer(VkBufferUsageFlags bufferUsage, VkDeviceSize buffe
 
 	int32_t memIndex = FindMemoryIndex(memoryRequirements.memoryTypeBits, memoryFlagBit);
 
-	VkMemoryAllocateInfo allocateInfo;
-	allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocateInfo.pNext = nullptr;
-	allocateInfo.allocationSize = static_cast<uint32_t>(memoryRequirements.size);
-	allocateInfo.memoryTypeIndex = memIndex;
-
-	VK_CHECK(vkAllocateMemory(
-		mDevice,
-		&allocateInfo,
-		nullptr,
-		&buffer.memory
-	));
+	buffer.allocation = mAllocator->Allocate(memoryRequirements, memIndex, true);
 
 	return buffer;
 }
@@ -1676,56 +2830,106 @@ Buffer Renderer::CreateUploadBuffer(VkDeviceSize bufferSize) const
 	vkGetBufferMemoryRequirements(mDevice, buffer.buffer, &memoryRequirements);
 	buffer.size = static_cast<uint32_t>(memoryRequirements.size);
 
-	VkMemoryPropertyFlagBits memoryFlagBit = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+	// Coherent, the staging ring is written through a persistent mapping and never flushed.
+	VkMemoryPropertyFlags memoryFlagBit = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 
 	int32_t memIndex = FindMemoryIndex(memoryRequirements.memoryTypeBits, memoryFlagBit);
 
-	VkMemoryAllocateInfo allocateInfo;
-	allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocateInfo.pNext = nullptr;
-	allocateInfo.allocationSize = memoryRequirements.size;
-	allocateInfo.memoryTypeIndex = memIndex;
-
-	VK_CHECK(vkAllocateMemory(
-		mDevice,
-		&allocateInfo,
-		nullptr,
-		&buffer.memory
-	));
+	buffer.allocation = mAllocator->Allocate(memoryRequirements, memIndex, true);
 
 	return buffer;
 }
 
-void Renderer::UploadToBuffer(Buffer& destinationBuffer, Buffer& uploadBuffer, const void* data, VkDeviceSize bufferSize)
+void Renderer::UploadToBuffer(Buffer& destinationBuffer, VkDeviceSize destinationOffset, const void* data, VkDeviceSize dataSize)
 {
-	VK_CHECK(vkDeviceWaitIdle(mDevice));
-	void* mappedData = nullptr;
-	VK_CHECK(vkMapMemory(
-		mDevice,
-		uploadBuffer.memory,
-		0,
-		bufferSize,
-		0,
-		&mappedData
-	));
+	// A lone upload is a batch of one.
+	bool implicitBatch = !mUploadBatch.open;
+	if (implicitBatch)
+		BeginUploadBatch();
 
-	memcpy(mappedData, data, static_cast<size_t>(bufferSize));
+	RetireUploads(false);
 
-	VkBufferCopy bufferCopy;
-	bufferCopy.srcOffset = 0;
-	bufferCopy.dstOffset = 0;
-	bufferCopy.size = bufferSize;
+	// Anything bigger than half the ring is split, so a chunk always fits once the ring drains.
+	const VkDeviceSize maxChunkSize = mStagingRing.GetCapacity() / 2;
+	const VkDeviceSize alignment = std::max<VkDeviceSize>(mPhysicalDevice.properties.limits.optimalBufferCopyOffsetAlignment, 4);
+	const char* source = static_cast<const char*>(data);
 
-	VK_CHECK(vkResetCommandPool(
-		mDevice,
-		mMainTransferCmdPool,
-		0
-	));
+	while (dataSize > 0)
+	{
+		VkDeviceSize chunkSize = std::min(dataSize, maxChunkSize);
+		VkDeviceSize stagingOffset = 0;
+		void* mappedData = nullptr;
 
-	VK_CHECK(vkResetCommandBuffer(
-		mMainTransferCmd,
-		0
-	));
+		while (!mStagingRing.Allocate(chunkSize, alignment, stagingOffset, mappedData))
+		{
+			// The ring is full, submit what the batch has so far and wait for the oldest upload to give its space back.
+			FlushUploadBatch();
+			assert(!mPendingUploads.empty() && "Staging ring is full but nothing is in flight.");
+			RetireUploads(true);
+		}
+
+		memcpy(mappedData, source, static_cast<size_t>(chunkSize));
+
+		VkBufferCopy bufferCopy;
+		bufferCopy.srcOffset = stagingOffset;
+		bufferCopy.dstOffset = destinationOffset;
+		bufferCopy.size = chunkSize;
+		AddUploadRegion(destinationBuffer.buffer, bufferCopy);
+
+		source += chunkSize;
+		destinationOffset += chunkSize;
+		dataSize -= chunkSize;
+	}
+
+	if (implicitBatch)
+		EndUploadBatch();
+}
+
+void Renderer::BeginUploadBatch()
+{
+	assert(!mUploadBatch.open && "Upload batches can't be nested.");
+	mUploadBatch.open = true;
+}
+
+void Renderer::EndUploadBatch()
+{
+	assert(mUploadBatch.open && "EndUploadBatch without BeginUploadBatch.");
+	FlushUploadBatch();
+	mUploadBatch.open = false;
+}
+
+void Renderer::AddUploadRegion(VkBuffer destination, const VkBufferCopy& region)
+{
+	size_t i = 0;
+	while (i < mUploadBatch.destinations.size() && mUploadBatch.destinations[i] != destination)
+		i++;
+
+	if (i == mUploadBatch.destinations.size())
+	{
+		mUploadBatch.destinations.push_back(destination);
+		mUploadBatch.regions.emplace_back();
+	}
+
+	std::vector<VkBufferCopy>& regions = mUploadBatch.regions[i];
+	if (!regions.empty())
+	{
+		// Chunks of one upload usually land back to back in the ring, those become a single region.
+		VkBufferCopy& last = regions.back();
+		if (last.srcOffset + last.size == region.srcOffset && last.dstOffset + last.size == region.dstOffset)
+		{
+			last.size += region.size;
+			return;
+		}
+	}
+	regions.push_back(region);
+}
+
+void Renderer::FlushUploadBatch()
+{
+	if (mUploadBatch.destinations.empty())
+		return;
+
+	UploadContext context = AcquireUploadContext();
 
 	VkCommandBufferBeginInfo beginInfo;
 	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -1733,28 +2937,162 @@ void Renderer::UploadToBuffer(Buffer& destinationBuffer, Buffer& uploadBuffer, c
 	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 	beginInfo.pInheritanceInfo = nullptr;
 
-	VK_CHECK(vkBeginCommandBuffer(mMainTransferCmd, &beginInfo));
+	VK_CHECK(vkBeginCommandBuffer(context.CommandBuffer, &beginInfo));
 
-	vkCmdCopyBuffer(mMainTransferCmd, uploadBuffer.buffer, destinationBuffer.buffer, 1, &bufferCopy);
-	
-	VK_CHECK(vkEndCommandBuffer(mMainTransferCmd));
+	bool transferOwnership = mDeviceInfo.transferQueueIndex != mDeviceInfo.graphicsQueueIndex;
+	std::vector<VkBufferMemoryBarrier> releaseBarriers;
+
+	for (size_t i = 0; i < mUploadBatch.destinations.size(); i++)
+	{
+		const std::vector<VkBufferCopy>& regions = mUploadBatch.regions[i];
+
+		vkCmdCopyBuffer(
+			context.CommandBuffer,
+			mStagingBuffer.buffer,
+			mUploadBatch.destinations[i],
+			static_cast<uint32_t>(regions.size()),
+			regions.data()
+		);
+
+		if (transferOwnership)
+		{
+			// Release half of the ownership transfer, the graphics queue records the matching acquire.
+			for (const VkBufferCopy& region : regions)
+			{
+				VkBufferMemoryBarrier barrier;
+				barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+				barrier.pNext = nullptr;
+				barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+				barrier.dstAccessMask = 0;
+				barrier.srcQueueFamilyIndex = mDeviceInfo.transferQueueIndex;
+				barrier.dstQueueFamilyIndex = mDeviceInfo.graphicsQueueIndex;
+				barrier.buffer = mUploadBatch.destinations[i];
+				barrier.offset = region.dstOffset;
+				barrier.size = region.size;
+				releaseBarriers.push_back(barrier);
+
+				barrier.srcAccessMask = 0;
+				barrier.dstAccessMask = uploadConsumerAccess;
+				mPendingAcquireBarriers.push_back(barrier);
+			}
+		}
+	}
+
+	if (!releaseBarriers.empty())
+	{
+		vkCmdPipelineBarrier(
+			context.CommandBuffer,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			0,
+			0u,
+			nullptr,
+			static_cast<uint32_t>(releaseBarriers.size()),
+			releaseBarriers.data(),
+			0u,
+			nullptr
+		);
+	}
+
+	VK_CHECK(vkEndCommandBuffer(context.CommandBuffer));
+
+	context.TimelineValue = ++mTransferTimelineValue;
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo;
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.pNext = nullptr;
+	timelineInfo.waitSemaphoreValueCount = 0;
+	timelineInfo.pWaitSemaphoreValues = nullptr;
+	timelineInfo.signalSemaphoreValueCount = 1;
+	timelineInfo.pSignalSemaphoreValues = &context.TimelineValue;
 
 	VkSubmitInfo submitInfo;
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.pNext = nullptr;
+	submitInfo.pNext = &timelineInfo;
 	submitInfo.waitSemaphoreCount = 0;
 	submitInfo.pWaitSemaphores = nullptr;
-	submitInfo.signalSemaphoreCount = 0;
-	submitInfo.pSignalSemaphores = nullptr;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &mTransferTimeline;
 	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &mMainTransferCmd;
+	submitInfo.pCommandBuffers = &context.CommandBuffer;
 	submitInfo.pWaitDstStageMask = nullptr;
 
 	VK_CHECK(vkQueueSubmit(mTransferQueue, 1u, &submitInfo, nullptr));
 
-	VK_CHECK(vkDeviceWaitIdle(mDevice));
+	mStagingRing.Submit(context.TimelineValue);
+	mPendingUploads.push_back(context);
+	mGraphicsUploadWaitValue = context.TimelineValue;
+
+	mUploadBatch.destinations.clear();
+	mUploadBatch.regions.clear();
+}
+
+UploadContext Renderer::AcquireUploadContext()
+{
+	UploadContext context;
+	if (!mFreeUploadContexts.empty())
+	{
+		context = mFreeUploadContexts.back();
+		mFreeUploadContexts.pop_back();
+		VK_CHECK(vkResetCommandBuffer(context.CommandBuffer, 0));
+	}
+	else
+	{
+		context.CommandBuffer = AllocateCommandBuffer(mMainTransferCmdPool);
+	}
+	context.TimelineValue = 0;
+
+	return context;
+}
+
+void Renderer::RetireUploads(bool waitForOldest)
+{
+	if (mPendingUploads.empty())
+		return;
+
+	uint64_t completedValue = 0;
+	VK_CHECK(vkGetSemaphoreCounterValue(mDevice, mTransferTimeline, &completedValue));
+
+	if (waitForOldest && completedValue < mPendingUploads.front().TimelineValue)
+	{
+		WaitForTimelineValue(mTransferTimeline, mPendingUploads.front().TimelineValue);
+		completedValue = mPendingUploads.front().TimelineValue;
+	}
+
+	while (!mPendingUploads.empty() && mPendingUploads.front().TimelineValue <= completedValue)
+	{
+		mFreeUploadContexts.push_back(mPendingUploads.front());
+		mPendingUploads.pop_front();
+	}
+	mStagingRing.Retire(completedValue);
+}
+
+void Renderer::WaitForTimelineValue(VkSemaphore timeline, uint64_t value) const
+{
+	VkSemaphoreWaitInfo waitInfo;
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.pNext = nullptr;
+	waitInfo.flags = 0;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &timeline;
+	waitInfo.pValues = &value;
+
+	VK_CHECK(vkWaitSemaphores(mDevice, &waitInfo, UINT64_MAX));
+}
+
+bool Renderer::IsGraphicsValueComplete(uint64_t value)
+{
+	if (value <= mGraphicsCompletedValue)
+		return true;
+
+	VK_CHECK(vkGetSemaphoreCounterValue(mDevice, mGraphicsTimeline, &mGraphicsCompletedValue));
+	return value <= mGraphicsCompletedValue;
+}
 
-	vkUnmapMemory(mDevice, uploadBuffer.memory);
+void Renderer::WaitForUploads()
+{
+	while (!mPendingUploads.empty())
+		RetireUploads(true);
 }
 
 void Renderer::BindBuffer(const Buffer& buffer, VkDeviceSize offset) const
@@ -1762,12 +3100,12 @@ void Renderer::BindBuffer(const Buffer& buffer, VkDeviceSize offset) const
 	VK_CHECK(vkBindBufferMemory(
 		mDevice,
 		buffer.buffer,
-		buffer.memory,
-		offset
+		buffer.allocation.memory,
+		buffer.allocation.offset + offset
 	));
 }
 
-Buffer Renderer::CreateUniformBuffer(uint64_t bufferSize) const
+Buffer Renderer::CreateUniformBuffer(uint64_t bufferSize, VkBufferUsageFlags bufferUsage) const
 {
 	Buffer buffer;
 	VkBufferCreateInfo createInfo;
@@ -1778,7 +3116,7 @@ Buffer Renderer::CreateUniformBuffer(uint64_t bufferSize) const
 	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 	createInfo.size = CalculateUniformBufferSize(bufferSize);
 	createInfo.flags = 0;
-	createInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	createInfo.usage = bufferUsage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 
 	VK_CHECK(vkCreateBuffer(mDevice, &createInfo, nullptr, &buffer.buffer));
 
@@ -1786,23 +3124,19 @@ Buffer Renderer::CreateUniformBuffer(uint64_t bufferSize) const
 	vkGetBufferMemoryRequirements(mDevice, buffer.buffer, &requirements);
 	buffer.size = static_cast<uint32_t>(requirements.size);
 
-	VkMemoryAllocateInfo allocateInfo;
-	allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocateInfo.memoryTypeIndex = FindMemoryIndex(
+	uint32_t memIndex = FindMemoryIndex(
 		requirements.memoryTypeBits,
 		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
 	);
-	allocateInfo.allocationSize = requirements.size;
-	allocateInfo.pNext = nullptr;
 
-	VK_CHECK(vkAllocateMemory(mDevice, &allocateInfo, nullptr, &buffer.memory));
+	buffer.allocation = mAllocator->Allocate(requirements, memIndex, true);
 
 	return buffer;
 }
 
-VkDescriptorSet Renderer::CreateDescriptorSet() const
+VkDescriptorSet Renderer::CreateDescriptorSet(VkDescriptorSetLayout layout) const
 {
 	VkDescriptorSet descriptorSet = nullptr;
 	VkDescriptorSetAllocateInfo allocateInfo;
@@ -1810,13 +3144,38 @@ VkDescriptorSet Renderer::CreateDescriptorSet() const
 	allocateInfo.pNext = nullptr;
 	allocateInfo.descriptorSetCount = 1;
 	allocateInfo.descriptorPool = mGlobalDescriptorPool;
-	allocateInfo.pSetLayouts = &mGlobalDescriptorSetLayout;
+	allocateInfo.pSetLayouts = &layout;
 
 	VK_CHECK(vkAllocateDescriptorSets(mDevice, &allocateInfo, &descriptorSet));
 
 	return descriptorSet;
 }
 
+Buffer Renderer::CreateVertexBuffer(const std::vector<GeometryGenerator::Vertex>& vertices)
+{
+	const void* vertexData = vertices.data();
+	uint64_t vertexBufferSize = sizeof(GeometryGenerator::Vertex) * vertices.size();
+
+	std::vector<PackedVertex> packedVertices;
+	if (meshVertexLayout == VertexLayout::Packed)
+	{
+		packedVertices = PackVertices(vertices);
+		vertexData = packedVertices.data();
+		vertexBufferSize = sizeof(PackedVertex) * packedVertices.size();
+	}
+
+	printf("Vertex buffer: %zu vertices, %llu KB (%llu KB unpacked)\n", vertices.size(),
+		(unsigned long long)(vertexBufferSize / 1024), (unsigned long long)(sizeof(GeometryGenerator::Vertex) * vertices.size() / 1024));
+
+	Buffer vertexBuffer = CreateBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, vertexBufferSize, false);
+	BindBuffer(vertexBuffer);
+
+	// The staging copy happens right here, the packed vertices don't need to outlive the call.
+	UploadToBuffer(vertexBuffer, 0, vertexData, vertexBufferSize);
+
+	return vertexBuffer;
+}
+
 MeshGeometry Renderer::CreateMeshGeometry()
 {
 	MeshGeometry meshGeometry{};
@@ -1865,44 +3224,42 @@ MeshGeometry Renderer::CreateMeshGeometry()
 	indices.insert(std::end(indices), std::begin(grid.Indices32), std::end(grid.Indices32));
 	indices.insert(std::end(indices), std::begin(box.Indices32), std::end(box.Indices32));
 
-	uint64_t vertexBufferSize = sizeof(GeometryGenerator::Vertex) * vertices.size();
-	meshGeometry.VertexBuffer = CreateBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, vertexBufferSize, false);
-	BindBuffer(meshGeometry.VertexBuffer);
-	
-	Buffer upBuf = CreateUploadBuffer(vertexBufferSize);
-	BindBuffer(upBuf);
-	UploadToBuffer(meshGeometry.VertexBuffer, upBuf, vertices.data(), upBuf.size);
-	DestroyBuffer(&upBuf);
+	BeginUploadBatch();
+
+	meshGeometry.VertexBuffer = CreateVertexBuffer(vertices);
 	
 	uint64_t indexBufferSize = sizeof(uint32_t) * indices.size();
 
 	meshGeometry.IndexBuffer = CreateBuffer(VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, indexBufferSize, false);
 	BindBuffer(meshGeometry.IndexBuffer);
 
-	upBuf = CreateUploadBuffer(indexBufferSize);
-	BindBuffer(upBuf);
-	UploadToBuffer(meshGeometry.IndexBuffer, upBuf, indices.data(), upBuf.size);
-	DestroyBuffer(&upBuf);
+	UploadToBuffer(meshGeometry.IndexBuffer, 0, indices.data(), indexBufferSize);
+
+	EndUploadBatch();
 
 	SubmeshGeometry cylinderSubmesh;
 	cylinderSubmesh.indexCount = static_cast<uint32_t>(cylinder.Indices32.size());
 	cylinderSubmesh.firstIndex = 0;
 	cylinderSubmesh.vertexOffset = 0;
+	cylinderSubmesh.Bounds = GeometryGenerator::ComputeBounds(cylinder.Vertices);
 
 	SubmeshGeometry geoSphereSubmesh;
 	geoSphereSubmesh.indexCount = static_cast<uint32_t>(geoSphere.Indices32.size());
 	geoSphereSubmesh.firstIndex = (uint32_t)cylinder.Indices32.size();
 	geoSphereSubmesh.vertexOffset = (uint32_t)cylinder.Vertices.size();
+	geoSphereSubmesh.Bounds = GeometryGenerator::ComputeBounds(geoSphere.Vertices);
 
 	SubmeshGeometry gridSubmesh;
 	gridSubmesh.indexCount = static_cast<uint32_t>(grid.Indices32.size());
 	gridSubmesh.firstIndex = static_cast<uint32_t>(cylinder.Indices32.size() + geoSphere.Indices32.size());
 	gridSubmesh.vertexOffset = static_cast<uint32_t>(cylinder.Vertices.size() + geoSphere.Vertices.size());
+	gridSubmesh.Bounds = GeometryGenerator::ComputeBounds(grid.Vertices);
 
 	SubmeshGeometry boxSubmesh;
 	boxSubmesh.indexCount = static_cast<uint32_t>(box.Indices32.size());
 	boxSubmesh.firstIndex = static_cast<uint32_t>(cylinder.Indices32.size() + geoSphere.Indices32.size() + grid.Indices32.size());
 	boxSubmesh.vertexOffset = static_cast<uint32_t>(cylinder.Vertices.size() + geoSphere.Vertices.size() + grid.Vertices.size());
+	boxSubmesh.Bounds = GeometryGenerator::ComputeBounds(box.Vertices);
 
 	meshGeometry.Geometries["Cylinder"] = cylinderSubmesh;
 	meshGeometry.Geometries["Sphere"] = geoSphereSubmesh;
@@ -1921,8 +3278,8 @@ void Renderer::UpdateGlobalUniformData(GlobalUniform& globalUniform) const
 	XMMATRIX view = XMMatrixLookAtLH(mEyePosition, center, up);
 
 	/* Projection */
-	float width = (float)mWindow->GetWindowWidth();
-	float height = (float)mWindow->GetWindowHeight();
+	float width = (float)mSwapchainExtent.width;
+	float height = (float)mSwapchainExtent.height;
 	float aspectRatio = width / height;
 	float nearZ = 0.1f;
 	float farZ = 1000.f;
@@ -1963,11 +3320,16 @@ void Renderer::CalculateDeltaTime()
 	mFps++;
 	if (mAccumulatedDelta >= 1.0)
 	{
-		char fpsString[50];
-		snprintf(fpsString, sizeof(fpsString), "Vulkan Application | FPS: %d", mFps);
+		double recordMicroseconds = mRecordedFrames > 0 ? mRecordTimeAccum * 1000000.0 / mRecordedFrames : 0.0;
+		char fpsString[192];
+		snprintf(fpsString, sizeof(fpsString), "Vulkan Application | FPS: %d | Draws: %u | Visible: %u | Culled: %zu | Binds avoided: %u | Record: %.1f us%s",
+			mFps, mDrawCallCount, mVisibleCount, mRenderItems.size() - mVisibleCount, mDrawPath == DrawPath::Direct ? mAvoidedBindCount : 0u, recordMicroseconds,
+			mReusedCommandBuffer ? " (cached)" : "");
 		mWindow->ChangeWindowTitle(fpsString);
 		mAccumulatedDelta = 0.0;
 		mFps = 0;
+		mRecordTimeAccum = 0.0;
+		mRecordedFrames = 0;
 	}
 }
 
@@ -1980,6 +3342,7 @@ void Renderer::BuildShapesRenderItems()
 	box.firstIndex = mMeshGeometry.Geometries["Box"].firstIndex;
 	box.indexCount = mMeshGeometry.Geometries["Box"].indexCount;
 	box.vertexOffset = mMeshGeometry.Geometries["Box"].vertexOffset;
+	box.Bounds = mMeshGeometry.Geometries["Box"].Bounds;
 	box.uniformBufferIndex = uniformBufferIndex++;
 	XMStoreFloat4x4(&box.UniformBuffer.model, XMMatrixTranslation(0.0f, 0.5f, 0.0f));
 	mRenderItems[box.uniformBufferIndex] = box;
@@ -1988,6 +3351,7 @@ void Renderer::BuildShapesRenderItems()
 	grid.firstIndex = mMeshGeometry.Geometries["Grid"].firstIndex;
 	grid.indexCount = mMeshGeometry.Geometries["Grid"].indexCount;
 	grid.vertexOffset = mMeshGeometry.Geometries["Grid"].vertexOffset;
+	grid.Bounds = mMeshGeometry.Geometries["Grid"].Bounds;
 	grid.MeshGeo = &mMeshGeometry;
 	XMStoreFloat4x4(&grid.UniformBuffer.model, XMMatrixIdentity());
 	grid.uniformBufferIndex = uniformBufferIndex++;
@@ -2016,24 +3380,28 @@ void Renderer::BuildShapesRenderItems()
 		leftCylinder.firstIndex = mMeshGeometry.Geometries["Cylinder"].firstIndex;
 		leftCylinder.indexCount = mMeshGeometry.Geometries["Cylinder"].indexCount;
 		leftCylinder.vertexOffset = mMeshGeometry.Geometries["Cylinder"].vertexOffset;
+		leftCylinder.Bounds = mMeshGeometry.Geometries["Cylinder"].Bounds;
 		leftCylinder.MeshGeo = &mMeshGeometry;
 		leftCylinder.uniformBufferIndex = uniformBufferIndex++;
 
 		rightCylinder.firstIndex = mMeshGeometry.Geometries["Cylinder"].firstIndex;
 		rightCylinder.indexCount = mMeshGeometry.Geometries["Cylinder"].indexCount;
 		rightCylinder.vertexOffset = mMeshGeometry.Geometries["Cylinder"].vertexOffset;
+		rightCylinder.Bounds = mMeshGeometry.Geometries["Cylinder"].Bounds;
 		rightCylinder.MeshGeo = &mMeshGeometry;
 		rightCylinder.uniformBufferIndex = uniformBufferIndex++;
 
 		leftSphere.firstIndex = mMeshGeometry.Geometries["Sphere"].firstIndex;
 		leftSphere.indexCount = mMeshGeometry.Geometries["Sphere"].indexCount;
 		leftSphere.vertexOffset = mMeshGeometry.Geometries["Sphere"].vertexOffset;
+		leftSphere.Bounds = mMeshGeometry.Geometries["Sphere"].Bounds;
 		leftSphere.MeshGeo = &mMeshGeometry;
 		leftSphere.uniformBufferIndex = uniformBufferIndex++;
 
 		rightSphere.firstIndex = mMeshGeometry.Geometries["Sphere"].firstIndex;
 		rightSphere.indexCount = mMeshGeometry.Geometries["Sphere"].indexCount;
 		rightSphere.vertexOffset = mMeshGeometry.Geometries["Sphere"].vertexOffset;
+		rightSphere.Bounds = mMeshGeometry.Geometries["Sphere"].Bounds;
 		rightSphere.MeshGeo = &mMeshGeometry;
 		rightSphere.uniformBufferIndex = uniformBufferIndex++;
 
@@ -2053,15 +3421,179 @@ void Renderer::BuildLandRenderItems()
 	land.firstIndex = mMeshGeometry.Geometries["Land"].firstIndex;
 	land.indexCount = mMeshGeometry.Geometries["Land"].indexCount;
 	land.vertexOffset = mMeshGeometry.Geometries["Land"].vertexOffset;
+	land.Bounds = mMeshGeometry.Geometries["Land"].Bounds;
 	land.uniformBufferIndex = uniformBufferIndex++;
 	XMStoreFloat4x4(&land.UniformBuffer.model, XMMatrixIdentity());
 	mRenderItems[land.uniformBufferIndex] = land;
+
+	// A forest of identical trees scattered over the hills.
+	const int treeRows = 10;
+	const float treeSpacing = 14.0f;
+	const SubmeshGeometry& trunkSubmesh = mMeshGeometry.Geometries["Trunk"];
+	const SubmeshGeometry& canopySubmesh = mMeshGeometry.Geometries["Canopy"];
+	for (int i = 0; i < treeRows; i++)
+	{
+		for (int j = 0; j < treeRows; j++)
+		{
+			float x = (i - (treeRows - 1) * 0.5f) * treeSpacing;
+			float z = (j - (treeRows - 1) * 0.5f) * treeSpacing;
+			float y = GetHillsHeight(x, z);
+
+			RenderItem trunk;
+			trunk.MeshGeo = &mMeshGeometry;
+			trunk.firstIndex = trunkSubmesh.firstIndex;
+			trunk.indexCount = trunkSubmesh.indexCount;
+			trunk.vertexOffset = trunkSubmesh.vertexOffset;
+			trunk.Bounds = trunkSubmesh.Bounds;
+			trunk.uniformBufferIndex = uniformBufferIndex++;
+			XMStoreFloat4x4(&trunk.UniformBuffer.model, XMMatrixTranslation(x, y + 1.5f, z));
+			mRenderItems.push_back(trunk);
+
+			RenderItem canopy;
+			canopy.MeshGeo = &mMeshGeometry;
+			canopy.firstIndex = canopySubmesh.firstIndex;
+			canopy.indexCount = canopySubmesh.indexCount;
+			canopy.vertexOffset = canopySubmesh.vertexOffset;
+			canopy.Bounds = canopySubmesh.Bounds;
+			canopy.uniformBufferIndex = uniformBufferIndex++;
+			XMStoreFloat4x4(&canopy.UniformBuffer.model, XMMatrixTranslation(x, y + 4.0f, z));
+			mRenderItems.push_back(canopy);
+		}
+	}
+}
+
+void Renderer::BuildInstanceBatches()
+{
+	mInstanceBatches.clear();
+
+	for (uint32_t i = 0; i < static_cast<uint32_t>(mRenderItems.size()); i++)
+	{
+		const RenderItem& rItem = mRenderItems[i];
+
+		InstanceBatch* batch = nullptr;
+		for (InstanceBatch& candidate : mInstanceBatches)
+		{
+			if (candidate.MeshGeo == rItem.MeshGeo &&
+				candidate.firstIndex == rItem.firstIndex &&
+				candidate.indexCount == rItem.indexCount &&
+				candidate.vertexOffset == rItem.vertexOffset)
+			{
+				batch = &candidate;
+				break;
+			}
+		}
+
+		if (!batch)
+		{
+			InstanceBatch newBatch;
+			newBatch.MeshGeo = rItem.MeshGeo;
+			newBatch.indexCount = rItem.indexCount;
+			newBatch.firstIndex = rItem.firstIndex;
+			newBatch.vertexOffset = rItem.vertexOffset;
+			newBatch.Bounds = rItem.Bounds;
+			newBatch.firstInstance = 0;
+			mInstanceBatches.push_back(newBatch);
+			batch = &mInstanceBatches.back();
+		}
+
+		batch->renderItems.push_back(i);
+	}
+
+	uint32_t firstInstance = 0;
+	std::vector<const MeshGeometry*> meshes;
+	for (uint32_t b = 0; b < static_cast<uint32_t>(mInstanceBatches.size()); b++)
+	{
+		InstanceBatch& batch = mInstanceBatches[b];
+		batch.firstInstance = firstInstance;
+		firstInstance += static_cast<uint32_t>(batch.renderItems.size());
+
+		uint32_t meshId = 0;
+		while (meshId < meshes.size() && meshes[meshId] != batch.MeshGeo)
+			meshId++;
+		if (meshId == meshes.size())
+			meshes.push_back(batch.MeshGeo);
+
+		for (uint32_t itemIndex : batch.renderItems)
+		{
+			mRenderItems[itemIndex].meshId = meshId;
+			mRenderItems[itemIndex].instanceBatch = b;
+		}
+	}
+
+	// Indirect commands are stored in batch order, every run of batches sharing a mesh is one indirect draw.
+	mIndirectRanges.clear();
+	for (const InstanceBatch& batch : mInstanceBatches)
+	{
+		if (mIndirectRanges.empty() || mIndirectRanges.back().MeshGeo != batch.MeshGeo)
+		{
+			IndirectDrawRange range;
+			range.MeshGeo = batch.MeshGeo;
+			range.firstCommand = batch.firstInstance;
+			range.commandCount = 0;
+			mIndirectRanges.push_back(range);
+		}
+		mIndirectRanges.back().commandCount += static_cast<uint32_t>(batch.renderItems.size());
+	}
+
+	printf("%zu render items in %zu instanced draws\n", mRenderItems.size(), mInstanceBatches.size());
+}
+
+void Renderer::CreateCullResources()
+{
+	// One entry per instance slot, so the slot is both the invocation and the instance index.
+	std::vector<CullItem> cullItems(mRenderItems.size());
+	for (uint32_t i = 0; i < static_cast<uint32_t>(mIndirectRanges.size()); i++)
+	{
+		const IndirectDrawRange& range = mIndirectRanges[i];
+		for (const InstanceBatch& batch : mInstanceBatches)
+		{
+			if (batch.firstInstance < range.firstCommand || batch.firstInstance >= range.firstCommand + range.commandCount)
+				continue;
+
+			for (uint32_t j = 0; j < static_cast<uint32_t>(batch.renderItems.size()); j++)
+			{
+				CullItem& item = cullItems[batch.firstInstance + j];
+				item = {};
+				item.boundingSphere = batch.Bounds.Sphere;
+				item.indexCount = batch.indexCount;
+				item.firstIndex = batch.firstIndex;
+				item.vertexOffset = static_cast<int32_t>(batch.vertexOffset);
+				item.firstCommand = range.firstCommand;
+				item.rangeIndex = i;
+			}
+		}
+	}
+
+	uint64_t cullItemBufferSize = sizeof(CullItem) * cullItems.size();
+	mCullItemBuffer = CreateBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, cullItemBufferSize, false);
+	BindBuffer(mCullItemBuffer);
+	UploadToBuffer(mCullItemBuffer, 0, cullItems.data(), cullItemBufferSize);
+
+	// Host visible so the visible count can be shown without another copy.
+	VkDeviceSize countFrameSize = CalculateUniformBufferSize(mIndirectRanges.size() * sizeof(uint32_t));
+	mDrawCountBuffer = CreateUniformBuffer(countFrameSize * framesInFlight, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+	BindBuffer(mDrawCountBuffer);
+	mDrawCountRing.Init(mAllocator, mDrawCountBuffer, countFrameSize, framesInFlight);
+	memset(mDrawCountRing.GetFrameData(0), 0, static_cast<size_t>(countFrameSize * framesInFlight));
+}
+
+void Renderer::UpdateCullDescriptorSet(uint32_t frameIndex) const
+{
+	VkDescriptorSet descriptorSet = mFrameResources[frameIndex].CullDescriptorSet;
+
+	UpdateDescriptorSet(mGlobalUniformBuffer, sizeof(GlobalUniform), descriptorSet, frameIndex, 0);
+	UpdateStorageDescriptorSet(mInstanceBuffer, descriptorSet, mInstanceRing.GetFrameOffset(frameIndex), mInstanceRing.GetFrameSize(), 1);
+	UpdateStorageDescriptorSet(mCullItemBuffer, descriptorSet, 0, VK_WHOLE_SIZE, 2);
+	UpdateStorageDescriptorSet(mIndirectBuffer, descriptorSet, mIndirectRing.GetFrameOffset(frameIndex), mIndirectRing.GetFrameSize(), 3);
+	UpdateStorageDescriptorSet(mDrawCountBuffer, descriptorSet, mDrawCountRing.GetFrameOffset(frameIndex), mDrawCountRing.GetFrameSize(), 4);
 }
 
 MeshGeometry Renderer::BuildLandGeometry()
 {
 	GeometryGenerator geoGen;
 	GeometryGenerator::MeshData grid = geoGen.CreateGrid(160.f, 160.f, 50, 50);
+	GeometryGenerator::MeshData trunk = geoGen.CreateCylinder(0.4f, 0.25f, 3.0f, 12, 4);
+	GeometryGenerator::MeshData canopy = geoGen.CreateSphere(1.5f, 12, 12);
 	MeshGeometry meshGeometry;
 
 	/*
@@ -2106,38 +3638,63 @@ MeshGeometry Renderer::BuildLandGeometry()
 		}
 	}
 
-	uint64_t vertexBufferSize = sizeof(GeometryGenerator::Vertex) * grid.Vertices.size();
-	meshGeometry.VertexBuffer = CreateBuffer(VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, vertexBufferSize, false);
-	BindBuffer(meshGeometry.VertexBuffer);
+	for (GeometryGenerator::Vertex& v : trunk.Vertices)
+		v.Color = XMFLOAT4(0.4f, 0.26f, 0.13f, 1.0f);
+
+	for (GeometryGenerator::Vertex& v : canopy.Vertices)
+		v.Color = XMFLOAT4(0.13f, 0.37f, 0.15f, 1.0f);
+
+	std::vector<GeometryGenerator::Vertex> vertices;
+	vertices.insert(std::end(vertices), std::begin(grid.Vertices), std::end(grid.Vertices));
+	vertices.insert(std::end(vertices), std::begin(trunk.Vertices), std::end(trunk.Vertices));
+	vertices.insert(std::end(vertices), std::begin(canopy.Vertices), std::end(canopy.Vertices));
 
-	Buffer upBuf = CreateUploadBuffer(vertexBufferSize);
-	BindBuffer(upBuf);
-	UploadToBuffer(meshGeometry.VertexBuffer, upBuf, grid.Vertices.data(), upBuf.size);
-	DestroyBuffer(&upBuf);
+	std::vector<uint32_t> indices;
+	indices.insert(std::end(indices), std::begin(grid.Indices32), std::end(grid.Indices32));
+	indices.insert(std::end(indices), std::begin(trunk.Indices32), std::end(trunk.Indices32));
+	indices.insert(std::end(indices), std::begin(canopy.Indices32), std::end(canopy.Indices32));
+
+	BeginUploadBatch();
+
+	meshGeometry.VertexBuffer = CreateVertexBuffer(vertices);
 
-	uint64_t indexBufferSize = sizeof(uint32_t) * grid.Indices32.size();
+	uint64_t indexBufferSize = sizeof(uint32_t) * indices.size();
 
 	meshGeometry.IndexBuffer = CreateBuffer(VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, indexBufferSize, false);
 	BindBuffer(meshGeometry.IndexBuffer);
 
-	upBuf = CreateUploadBuffer(indexBufferSize);
-	BindBuffer(upBuf);
-	UploadToBuffer(meshGeometry.IndexBuffer, upBuf, grid.Indices32.data(), upBuf.size);
-	DestroyBuffer(&upBuf);
+	UploadToBuffer(meshGeometry.IndexBuffer, 0, indices.data(), indexBufferSize);
+
+	EndUploadBatch();
 
 	SubmeshGeometry submesh;
 	submesh.firstIndex = 0;
 	submesh.indexCount = static_cast<uint32_t>(grid.Indices32.size());
 	submesh.vertexOffset = 0;
+	submesh.Bounds = GeometryGenerator::ComputeBounds(grid.Vertices);
+
+	SubmeshGeometry trunkSubmesh;
+	trunkSubmesh.firstIndex = static_cast<uint32_t>(grid.Indices32.size());
+	trunkSubmesh.indexCount = static_cast<uint32_t>(trunk.Indices32.size());
+	trunkSubmesh.vertexOffset = static_cast<uint32_t>(grid.Vertices.size());
+	trunkSubmesh.Bounds = GeometryGenerator::ComputeBounds(trunk.Vertices);
+
+	SubmeshGeometry canopySubmesh;
+	canopySubmesh.firstIndex = static_cast<uint32_t>(grid.Indices32.size() + trunk.Indices32.size());
+	canopySubmesh.indexCount = static_cast<uint32_t>(canopy.Indices32.size());
+	canopySubmesh.vertexOffset = static_cast<uint32_t>(grid.Vertices.size() + trunk.Vertices.size());
+	canopySubmesh.Bounds = GeometryGenerator::ComputeBounds(canopy.Vertices);
 
 	meshGeometry.Geometries["Land"] = submesh;
+	meshGeometry.Geometries["Trunk"] = trunkSubmesh;
+	meshGeometry.Geometries["Canopy"] = canopySubmesh;
 
 	return meshGeometry;
 }
 
 void Renderer::DestroyBuffer(Buffer* buffer) const
 {
-	vkFreeMemory(mDevice, buffer->memory, nullptr);
 	vkDestroyBuffer(mDevice, buffer->buffer, nullptr);
+	mAllocator->Free(buffer->allocation);
 	ZeroMemory(buffer, sizeof(*buffer));
 }
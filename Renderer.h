@@ -8,8 +8,16 @@
 #include "MeshGeometry.h"
 #include "RenderItem.h"
 #include "GeometryGenerator.h"
-
-#define VK_CHECK(expr) { if ((expr)) { throw EngineException(__FILE__, __LINE__, #expr); } }
+#include "MemoryAllocator.h"
+#include "UniformRing.h"
+#include "StagingRing.h"
+#include "FrustumCuller.h"
+#include "RenderQueue.h"
+#include "ThreadPool.h"
+#include "PipelineCache.h"
+#include "PipelineRegistry.h"
+#include "ShaderCache.h"
+#include "ShaderWatcher.h"
 
 class Window;
 
@@ -20,7 +28,8 @@ public:
 	~Renderer();
 	
 	void NotifyWindowResize(int width, int height);
-	void ToggleVSync() {};
+	// Switches to the next present mode the surface supports and reports how the previous one paced.
+	void ToggleVSync();
 
 	void Update();
 	void Draw();
@@ -41,54 +50,168 @@ private:
 	VkPhysicalDeviceInfo ChoosePhysicalDevice() const;
 	VkDeviceInfo CreateLogicalDevice() const;
 	VkCommandPool CreateCommandPool(uint32_t queueFamilyIndex) const;
-	VkCommandBuffer AllocateCommandBuffer(VkCommandPool commandPool) const;
+	VkCommandBuffer AllocateCommandBuffer(VkCommandPool commandPool, VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY) const;
+	void CreateImageCommandBuffers(FrameResources& frameRes) const;
+	void DestroyImageCommandBuffers(FrameResources& frameRes) const;
 	VkSurfaceKHR CreateVulkanSurface() const;
-	VkSwapchainKHR CreateSwapchain(VkSurfaceFormatKHR& out_swapchainSurfaceFormat) const;
+	VkSwapchainKHR CreateSwapchain(VkSurfaceFormatKHR& out_swapchainSurfaceFormat, VkExtent2D& out_swapchainExtent, VkSwapchainKHR oldSwapchain = nullptr) const;
+	std::vector<VkPresentModeKHR> GetSupportedPresentModes() const;
+	// Replaces the swapchain and everything sized by it, the render pass and frame resources stay.
+	// The old objects are retired instead of waiting for the GPU to let go of them.
+	void RecreateSwapchain();
+	void ReleaseRetiredSwapchains(bool releaseAll);
+	void UpdateViewportAndScissor();
+	// Starts or stops watching the GLSL sources, toggled with H.
+	void ToggleShaderHotReload();
+	// Runs on the watcher thread, builds new pipelines for every pipeline that uses one of the shaders.
+	void RebuildPipelines(const std::vector<std::string>& spirvPaths);
+	// Swaps the rebuilt pipelines in, the old ones are destroyed once the frames using them are done.
+	// Registry pipelines only get new descs, ResolveGraphicsPipelines switches once they are compiled.
+	void ApplyReloadedPipelines();
+	// Looks up the pipelines for this frame's descs and variant, keeping the current ones while new ones compile.
+	void ResolveGraphicsPipelines();
+	// The state every scene pipeline shares, they only differ in where the transforms come from.
+	GraphicsPipelineDesc MakeGraphicsPipelineDesc(ObjectDataPath objectData);
+	void ReleaseRetiredPipelines(bool releaseAll);
 	uint32_t GetSwapchainImagesCount() const;
 	std::vector<VkImage> GetSwapchainImages(uint32_t imageCount) const;
 	Image CreateDepthBuffer() const;
 	VkImageView CreateImageView(VkFormat viewFormat, VkImage image, VkImageAspectFlags imageAspect) const;
-	VkShaderModule CreateShaderModule(const char* shaderPath) const;
+	VkShaderModule CreateShaderModule(const char* shaderPath);
 	VkRenderPass CreateRenderPass() const;
 	VkFramebuffer CreateFramebuffer(VkRenderPass renderpass, uint32_t numImageViews, VkImageView* imageViews, uint32_t width, uint32_t height) const;
+	// Image views, framebuffers and present semaphores, one of each per swapchain image.
+	void CreateSwapchainImageResources();
+	void DestroySwapchainImageResources();
 	Buffer CreateGlobalUniformBuffer(uint32_t numFrames) const;
-	VkDescriptorSetLayout CreateDescriptorSetLayout() const;
+	VkDescriptorSetLayout CreateDescriptorSetLayout(VkDescriptorType descriptorType) const;
 	VkDescriptorPool CreateDescriptorPool() const;
 	std::vector<VkDescriptorSet> AllocateGlobalDescriptorSets() const;
-	void UpdateUniformBuffer(Buffer buffer, uint64_t bufferStride, uint64_t offset, void* data) const;
-	void UpdateDescriptorSet(Buffer buffer, uint64_t bufferStride, VkDescriptorSet descriptorSet, uint64_t offset, uint32_t binding) const;
+	void UpdateDescriptorSet(Buffer buffer, uint64_t bufferStride, VkDescriptorSet descriptorSet, uint64_t offset, uint32_t binding, VkDescriptorType descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) const;
+	void UpdateStorageDescriptorSet(Buffer buffer, VkDescriptorSet descriptorSet, VkDeviceSize offset, VkDeviceSize range, uint32_t binding) const;
 	VkPipelineLayout CreatePipelineLayout() const;
-	VkPipeline CreateVulkanPipeline() const;
-	VkFence CreateVulkanFence() const;
+	VkPipeline CreateVulkanPipeline(const GraphicsPipelineDesc& desc) const;
+	VkDescriptorSetLayout CreateCullDescriptorSetLayout() const;
+	VkPipelineLayout CreateCullPipelineLayout() const;
+	VkPipeline CreateComputePipeline(const char* shaderPath, VkPipelineLayout pipelineLayout);
 	VkSemaphore CreateSemaphore() const;
+	VkSemaphore CreateTimelineSemaphore(uint64_t initialValue) const;
+	// Blocks until the timeline reaches value, returns right away when it already has.
+	void WaitForTimelineValue(VkSemaphore timeline, uint64_t value) const;
+	// True once every graphics submit up to and including value has finished.
+	bool IsGraphicsValueComplete(uint64_t value);
 	int32_t FindMemoryIndex(uint32_t memoryTypeBits, VkMemoryPropertyFlags requestedMemoryType) const;
 	Buffer CreateBuffer(VkBufferUsageFlags bufferUsage, VkDeviceSize bufferSize, bool cpuAccessible) const;
 	Buffer CreateUploadBuffer(VkDeviceSize bufferSize) const;
-	void UploadToBuffer(Buffer& destinationBuffer, Buffer& uploadBuffer, const void* data, VkDeviceSize bufferSize);
+	void UploadToBuffer(Buffer& destinationBuffer, VkDeviceSize destinationOffset, const void* data, VkDeviceSize dataSize);
+	// Uploads between Begin and End are recorded in one command buffer and go out in a single submit.
+	// The ranges written to one buffer inside a batch must not overlap.
+	void BeginUploadBatch();
+	void EndUploadBatch();
+	void AddUploadRegion(VkBuffer destination, const VkBufferCopy& region);
+	void FlushUploadBatch();
+	UploadContext AcquireUploadContext();
+	void RetireUploads(bool waitForOldest);
+	void WaitForUploads();
 	void BindBuffer(const Buffer& buffer, VkDeviceSize offset) const;
 	inline void BindBuffer(const Buffer& buffer) const { BindBuffer(buffer, 0); }
 	void DestroyBuffer(Buffer* buffer) const;
-	Buffer CreateUniformBuffer(uint64_t bufferSize) const;
-	VkDescriptorSet CreateDescriptorSet() const;
+	// Host visible device local memory, for data the CPU rewrites every frame.
+	Buffer CreateUniformBuffer(uint64_t bufferSize, VkBufferUsageFlags bufferUsage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) const;
+	VkDescriptorSet CreateDescriptorSet(VkDescriptorSetLayout layout) const;
+	// Converts the vertices to meshVertexLayout and uploads them, needs an open upload batch.
+	Buffer CreateVertexBuffer(const std::vector<GeometryGenerator::Vertex>& vertices);
 	MeshGeometry CreateMeshGeometry();
 	void UpdateGlobalUniformData(GlobalUniform& globalUniform) const;
 	void CalculateDeltaTime();
 	MeshGeometry BuildLandGeometry();
 	void BuildShapesRenderItems();
 	void BuildLandRenderItems();
+	void BuildInstanceBatches();
+	void BuildRenderQueue();
+	// Returns the number of bind calls it recorded.
+	uint32_t BindDirectPipeline(VkCommandBuffer cmdBuf) const;
+	// Records the queue entries in [begin, end) and returns the number of draws, binds are added to out_bindCount.
+	uint32_t RecordDirectDrawRange(VkCommandBuffer cmdBuf, size_t begin, size_t end, uint32_t& out_bindCount) const;
+	void RecordCommandBuffer(ImageCommandBuffers& commands);
+	// True when the frame's last recording matches what this frame would record.
+	bool CanReuseCommandBuffer(const ImageCommandBuffers& commands) const;
+	// Call whenever render items, pipelines, framebuffers or the viewport change.
+	void InvalidateCommandBuffers();
+	void RecordDirectDraws(VkCommandBuffer cmdBuf);
+	// Splits the render queue across the recording threads, each one fills its own secondary command buffer.
+	void RecordDirectDrawsParallel(VkCommandBuffer cmdBuf, ImageCommandBuffers& commands);
+	void RecordInstancedDraws(VkCommandBuffer cmdBuf);
+	void RecordIndirectDraws(VkCommandBuffer cmdBuf);
+	void BindInstancedPipeline(VkCommandBuffer cmdBuf) const;
+	// Binds sets 0 to 2 in one call. Every scene pipeline specializes the same vertex shader,
+	// which statically uses all three sets whatever its transform source.
+	void BindSceneDescriptorSets(VkCommandBuffer cmdBuf) const;
+	void CullRenderItems();
+	void WriteInstanceData();
+	void WriteObjectData();
+	void WriteIndirectCommands();
+	void CreateCullResources();
+	void UpdateCullDescriptorSet(uint32_t frameIndex) const;
+	void RecordCullDispatch(VkCommandBuffer cmdBuf);
+	void ReadBackVisibleCount();
 	float GetHillsHeight(float x, float z) const
 	{
 		return 0.3f * (z * sinf(0.1f * x) + (x * cosf(0.1f * z)));
 	}
 
 private:
-	static constexpr int shaderCodeMaxSize = 1024 * 10;
+	static constexpr VkDeviceSize stagingBufferSize = 32ull * 1024 * 1024;
+	// What the mesh vertex buffers hold, Geometry uploads the generator's vertices unchanged.
+	static constexpr VertexLayout meshVertexLayout = VertexLayout::Packed;
+	static constexpr uint32_t maxRecordThreads = 8;
+	// Frames the CPU may record ahead of the GPU, independent of how many images the swapchain has.
+	// 2 keeps the latency down, 3 gives the CPU more slack when frame times vary.
+	static constexpr uint32_t framesInFlight = 2;
+	// Below this many draws per thread waking another worker costs more than it saves.
+	static constexpr size_t minDrawsPerRecordThread = 256;
+	// Everything that may read an uploaded buffer, the graphics queue waits on the transfer timeline at these stages.
+	static constexpr VkPipelineStageFlags uploadConsumerStages = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+		VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	static constexpr VkAccessFlags uploadConsumerAccess = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+		VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
 	Timer mTimer;
 
+	static constexpr const char* pipelineCachePath = "./pipeline_cache.bin";
+	PipelineCache mPipelineCache;
+	ShaderCache mShaderCache;
+
 	bool mResizing = false;
 
 	double mAccumulatedDelta = 0.0;
 	int mFps = 0;
+	uint32_t mDrawCallCount = 0;
+	uint32_t mVisibleCount = 0;
+
+	// CPU frustum culling for every path but the GPU culled one, toggled with C.
+	bool mCpuCulling = true;
+	FrustumCuller mFrustumCuller;
+	std::vector<uint8_t> mItemVisibility;
+	// Visible instances of every batch and visible commands of every indirect range this frame.
+	std::vector<uint32_t> mBatchVisibleCounts;
+	std::vector<uint32_t> mRangeVisibleCounts;
+
+	// Sorted visible items of the direct path, and the bind calls the sorting saved this frame.
+	RenderQueue mRenderQueue;
+	uint32_t mAvoidedBindCount = 0;
+
+	// Direct path recording on worker threads into secondary command buffers, toggled with T.
+	bool mParallelRecording = true;
+	ThreadPool* mRecordThreads = nullptr;
+
+	ObjectDataPath mObjectDataPath = ObjectDataPath::StorageBuffer;
+	// Submit the previous recording for the same frame slot and swapchain image again when nothing it depends on changed, toggled with R.
+	bool mCachedCommandBuffers = true;
+	bool mReusedCommandBuffer = false;
+	// CPU time spent recording the command buffer, averaged over the frames of the last title update.
+	Timer mRecordTimer;
+	double mRecordTimeAccum = 0.0;
+	uint32_t mRecordedFrames = 0;
 	float mDeltaTime = 0.0f;
 
 	const Window* mWindow;
@@ -99,31 +222,72 @@ private:
 	VkDevice mDevice = nullptr;
 	VkDeviceInfo mDeviceInfo;
 	uint32_t mGraphicsQueueIndex = 0;
+
+	MemoryAllocator* mAllocator = nullptr;
 	
 	VkQueue mGraphicsQueue = nullptr;
 	VkQueue mTransferQueue = nullptr;
 	
 	VkCommandBuffer mMainCmd = nullptr;
 	VkCommandPool mMainCmdPool = nullptr;
-	VkCommandBuffer mMainTransferCmd = nullptr;
 	VkCommandPool mMainTransferCmdPool = nullptr;
-	
-	VkFence mMainCopyFence = nullptr;
-	VkSemaphore mMainCopyDoneSemaphore = nullptr;
 
+	Buffer mStagingBuffer{};
+	StagingRing mStagingRing;
+	std::vector<UploadContext> mFreeUploadContexts;
+	// In flight uploads, oldest first.
+	std::deque<UploadContext> mPendingUploads;
+	UploadBatch mUploadBatch{};
+
+	// Signaled by the transfer queue, one value per upload submit.
+	VkSemaphore mTransferTimeline = nullptr;
+	uint64_t mTransferTimelineValue = 0;
+	// Signaled by the graphics queue, one value per frame. The completed value is cached so most checks
+	// are an integer comparison instead of a call into the driver.
+	VkSemaphore mGraphicsTimeline = nullptr;
+	uint64_t mGraphicsTimelineValue = 0;
+	uint64_t mGraphicsCompletedValue = 0;
+	// Value the next graphics submit has to wait on, 0 when there is nothing new to wait for.
+	uint64_t mGraphicsUploadWaitValue = 0;
+	// Acquire half of the queue family ownership transfers, recorded at the start of the next frame.
+	std::vector<VkBufferMemoryBarrier> mPendingAcquireBarriers;
+
+	// Swapchain image returned by the last acquire, and the frame in flight being recorded.
 	uint32_t mNextImageIndex = 0;
-	uint32_t mCurrentImageIndex = 0;
+	uint32_t mCurrentFrameIndex = 0;
 
 	Image mDepthBuffer{};
 
 	VkSurfaceKHR mSurface = nullptr;
 	VkSwapchainKHR mSwapchain = nullptr;
 	VkSurfaceFormatKHR mSwapchainSurfaceFormat = {};
+	// Size of the swapchain images, the window size can already be ahead of it while resizing.
+	VkExtent2D mSwapchainExtent = {};
+	VkPresentModeKHR mPresentMode = VK_PRESENT_MODE_FIFO_KHR;
+	std::vector<VkPresentModeKHR> mSupportedPresentModes;
+	PresentModeStats mPresentModeStats{};
+	Timer mAcquireTimer;
 
 	std::vector<VkImage> mImages;
 	std::vector<VkImageView> mImageViews;
+	std::vector<VkFramebuffer> mFramebuffers;
+	// Signaled by the submit that renders to the image, waited on by its present.
+	std::vector<VkSemaphore> mPresentSemaphores;
 	uint32_t mImageCount = 0;
+	// Oldest first.
+	std::deque<RetiredSwapchain> mRetiredSwapchains;
+	// Set when a present reports the swapchain no longer matches the surface, the next Update recreates it.
+	bool mSwapchainOutOfDate = false;
+
+	ShaderWatcher mShaderWatcher;
+	// Guards the reloaded pipelines and descs, the only state the watcher thread hands to the render thread.
+	std::mutex mReloadMutex;
+	std::vector<ReloadedPipeline> mReloadedPipelines;
+	std::vector<ReloadedPipelineDesc> mReloadedPipelineDescs;
+	// Oldest first.
+	std::deque<RetiredPipeline> mRetiredPipelines;
 
+	// One per frame in flight, indexed by mCurrentFrameIndex.
 	std::vector<FrameResources> mFrameResources;
 
 	VkRenderPass mRenderpass = nullptr;
@@ -136,12 +300,41 @@ private:
 	GlobalUniform mGlobalUniform{};
 	Buffer mGlobalUniformBuffer;
 	Buffer mObjectUniformBuffer;
+	UniformRing mGlobalUniformRing;
+	UniformRing mObjectUniformRing;
+	VkDescriptorSetLayout mObjectDescriptorSetLayout = nullptr;
+	VkDescriptorSetLayout mInstanceDescriptorSetLayout = nullptr;
+	Buffer mInstanceBuffer;
+	UniformRing mInstanceRing;
+	// One VkDrawIndexedIndirectCommand per render item and frame, in instance batch order.
+	Buffer mIndirectBuffer;
+	UniformRing mIndirectRing;
+
+	// Static per instance slot inputs of the culling pass, and one draw counter per indirect range and frame.
+	Buffer mCullItemBuffer;
+	Buffer mDrawCountBuffer;
+	UniformRing mDrawCountRing;
+	VkDescriptorSetLayout mCullDescriptorSetLayout = nullptr;
+	VkPipelineLayout mCullPipelineLayout = nullptr;
+	VkPipeline mCullPipeline = nullptr;
 
 	VkPipelineLayout mPipelineLayout = nullptr;
+	// Owned by the registry, resolved from the descs below at the start of every frame.
 	VkPipeline mGraphicsPipeline = nullptr;
+	VkPipeline mPushConstantPipeline = nullptr;
+	VkPipeline mInstancedPipeline = nullptr;
+	PipelineRegistry mPipelineRegistry;
+	GraphicsPipelineDesc mGraphicsPipelineDesc{};
+	GraphicsPipelineDesc mPushConstantPipelineDesc{};
+	GraphicsPipelineDesc mInstancedPipelineDesc{};
+	// Line fill variant of every scene pipeline, toggled with F.
+	bool mWireframe = false;
+	DrawPath mDrawPath = DrawPath::Instanced;
 
 	MeshGeometry mMeshGeometry;
 	std::vector<RenderItem> mRenderItems;
+	std::vector<InstanceBatch> mInstanceBatches;
+	std::vector<IndirectDrawRange> mIndirectRanges;
 
 	DirectX::XMVECTOR mEyePosition;
 	struct
@@ -152,5 +345,4 @@ private:
 	float mTheta = 0.0f;
 	float mPhi = 0.0f;
 	float mRadius = 10.f;
-	VkFence fence;
 };
@@ -0,0 +1,140 @@
+#include "ShaderCache.h"
+
+#include "EngineException.h"
+
+#include <Windows.h>
+#include <cstdio>
+
+static constexpr uint32_t spirvMagic = 0x07230203;
+// Magic, version, generator, bound and schema.
+static constexpr size_t spirvHeaderWords = 5;
+
+void ShaderCache::Init(VkDevice device)
+{
+	mDevice = device;
+	mFileReads = 0;
+	mModulesCreated = 0;
+}
+
+void ShaderCache::Release()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (auto& entry : mModulesByHash)
+		vkDestroyShaderModule(mDevice, entry.second, nullptr);
+
+	mModulesByHash.clear();
+	mModulesByPath.clear();
+}
+
+VkShaderModule ShaderCache::GetModule(const char* shaderPath)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	auto byPath = mModulesByPath.find(shaderPath);
+	if (byPath != mModulesByPath.end())
+		return byPath->second;
+
+	HANDLE file = CreateFileA(shaderPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_READONLY, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		printf("Failed to open shader %s\n", shaderPath);
+		throw std::exception("Failed to load Shader");
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(file);
+		throw std::exception("Failed to read Shader code");
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!view)
+	{
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		throw std::exception("Failed to map Shader code");
+	}
+
+	mFileReads++;
+
+	// Views are page aligned, so the code can be read as words straight from the mapping.
+	const uint32_t* code = static_cast<const uint32_t*>(view);
+	size_t codeSize = static_cast<size_t>(fileSize.QuadPart);
+
+	VkShaderModule shaderModule = nullptr;
+	if (IsValidSpirv(code, codeSize))
+	{
+		uint64_t hash = HashCode(code, codeSize);
+		auto byHash = mModulesByHash.find(hash);
+		if (byHash != mModulesByHash.end())
+		{
+			shaderModule = byHash->second;
+		}
+		else
+		{
+			shaderModule = CreateModule(code, codeSize);
+			mModulesByHash[hash] = shaderModule;
+		}
+	}
+
+	UnmapViewOfFile(view);
+	CloseHandle(mapping);
+	CloseHandle(file);
+
+	if (!shaderModule)
+	{
+		printf("Shader %s is not valid SPIR-V\n", shaderPath);
+		throw std::exception("Invalid Shader code");
+	}
+
+	mModulesByPath[shaderPath] = shaderModule;
+	return shaderModule;
+}
+
+void ShaderCache::InvalidatePath(const char* shaderPath)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mModulesByPath.erase(shaderPath);
+}
+
+bool ShaderCache::IsValidSpirv(const uint32_t* code, size_t codeSize)
+{
+	return codeSize % sizeof(uint32_t) == 0 &&
+		codeSize >= spirvHeaderWords * sizeof(uint32_t) &&
+		code[0] == spirvMagic;
+}
+
+uint64_t ShaderCache::HashCode(const uint32_t* code, size_t codeSize)
+{
+	// FNV-1a over the size and the words, shaders are small enough that this never shows up next to module creation.
+	uint64_t hash = 14695981039346656037ull;
+	hash ^= codeSize;
+	hash *= 1099511628211ull;
+	for (size_t i = 0; i < codeSize / sizeof(uint32_t); i++)
+	{
+		hash ^= code[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+VkShaderModule ShaderCache::CreateModule(const uint32_t* code, size_t codeSize)
+{
+	VkShaderModule shaderModule = 0;
+
+	VkShaderModuleCreateInfo createInfo;
+	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	createInfo.pNext = nullptr;
+	createInfo.codeSize = codeSize;
+	createInfo.flags = 0;
+	createInfo.pCode = code;
+
+	VK_CHECK(vkCreateShaderModule(mDevice, &createInfo, nullptr, &shaderModule));
+	mModulesCreated++;
+
+	return shaderModule;
+}
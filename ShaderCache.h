@@ -0,0 +1,41 @@
+#pragma once
+
+#include "HelperStructs.h"
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Owns every VkShaderModule of the renderer. Files are memory mapped at their real size and each
+// path is only read once, modules are keyed by a hash of the SPIR-V so identical code loaded from
+// different paths ends up in the same module. Pipelines don't destroy the modules they use.
+// Safe to use from the shader watcher thread while the render thread builds pipelines.
+class ShaderCache
+{
+public:
+	ShaderCache() = default;
+
+	void Init(VkDevice device);
+	void Release();
+
+	VkShaderModule GetModule(const char* shaderPath);
+	// The file at shaderPath changed, the next GetModule reads it again. Modules made from the old
+	// code stay alive, pipelines built from them keep working.
+	void InvalidatePath(const char* shaderPath);
+
+	uint32_t GetFileReads() const { return mFileReads; }
+	uint32_t GetModulesCreated() const { return mModulesCreated; }
+
+private:
+	// Magic number, a sane word count and a header that fits, anything else is not SPIR-V.
+	static bool IsValidSpirv(const uint32_t* code, size_t codeSize);
+	static uint64_t HashCode(const uint32_t* code, size_t codeSize);
+	VkShaderModule CreateModule(const uint32_t* code, size_t codeSize);
+
+	VkDevice mDevice = nullptr;
+	std::mutex mMutex;
+	std::unordered_map<std::string, VkShaderModule> mModulesByPath;
+	std::unordered_map<uint64_t, VkShaderModule> mModulesByHash;
+
+	uint32_t mFileReads = 0;
+	uint32_t mModulesCreated = 0;
+};
@@ -0,0 +1,135 @@
+#include "ShaderWatcher.h"
+
+#include <Windows.h>
+#include <chrono>
+#include <cstdio>
+
+ShaderWatcher::~ShaderWatcher()
+{
+	Stop();
+}
+
+void ShaderWatcher::Watch(const char* sourcePath, const char* spirvPath)
+{
+	WatchedShader shader;
+	shader.sourcePath = sourcePath;
+	shader.spirvPath = spirvPath;
+	shader.lastWriteTime = 0;
+	mShaders.push_back(shader);
+}
+
+bool ShaderWatcher::Start(CompiledCallback onCompiled)
+{
+	if (IsRunning())
+		return true;
+
+	char sdkPath[MAX_PATH];
+	DWORD sdkPathLength = GetEnvironmentVariableA("VULKAN_SDK", sdkPath, MAX_PATH);
+	if (sdkPathLength == 0 || sdkPathLength >= MAX_PATH)
+	{
+		printf("VULKAN_SDK isn't set, shaders can't be recompiled\n");
+		return false;
+	}
+	mCompilerPath = std::string(sdkPath) + "\\Bin\\glslc.exe";
+
+	// Whatever is on disk now is what the pipelines were built from, only later edits count.
+	for (WatchedShader& shader : mShaders)
+		shader.lastWriteTime = GetLastWriteTime(shader.sourcePath.c_str());
+
+	mOnCompiled = std::move(onCompiled);
+	mQuit = false;
+	mThread = std::thread(&ShaderWatcher::WatcherMain, this);
+	return true;
+}
+
+void ShaderWatcher::Stop()
+{
+	if (!IsRunning())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mQuitCondition.notify_all();
+	mThread.join();
+}
+
+void ShaderWatcher::WatcherMain()
+{
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			if (mQuitCondition.wait_for(lock, std::chrono::milliseconds(pollIntervalMs), [this] { return mQuit; }))
+				return;
+		}
+
+		std::vector<std::string> compiled;
+		for (WatchedShader& shader : mShaders)
+		{
+			uint64_t writeTime = GetLastWriteTime(shader.sourcePath.c_str());
+			if (writeTime == 0 || writeTime == shader.lastWriteTime)
+				continue;
+
+			// A failed compile still takes the new time, the next save gets another try.
+			shader.lastWriteTime = writeTime;
+			if (Compile(shader))
+				compiled.push_back(shader.spirvPath);
+		}
+
+		if (!compiled.empty())
+			mOnCompiled(compiled);
+	}
+}
+
+bool ShaderWatcher::Compile(const WatchedShader& shader) const
+{
+	std::string tempPath = shader.spirvPath + ".tmp";
+	std::string commandLine = "\"" + mCompilerPath + "\" \"" + shader.sourcePath + "\" -o \"" + tempPath + "\"";
+
+	STARTUPINFOA startupInfo;
+	ZeroMemory(&startupInfo, sizeof(startupInfo));
+	startupInfo.cb = sizeof(startupInfo);
+	PROCESS_INFORMATION processInfo;
+	ZeroMemory(&processInfo, sizeof(processInfo));
+
+	// glslc reports errors on the inherited console, which is where the rest of the log goes as well.
+	if (!CreateProcessA(mCompilerPath.c_str(), &commandLine[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startupInfo, &processInfo))
+	{
+		printf("Failed to run %s\n", mCompilerPath.c_str());
+		return false;
+	}
+
+	WaitForSingleObject(processInfo.hProcess, INFINITE);
+	DWORD exitCode = 1;
+	GetExitCodeProcess(processInfo.hProcess, &exitCode);
+	CloseHandle(processInfo.hThread);
+	CloseHandle(processInfo.hProcess);
+
+	if (exitCode != 0)
+	{
+		printf("%s failed to compile, keeping the previous version\n", shader.sourcePath.c_str());
+		DeleteFileA(tempPath.c_str());
+		return false;
+	}
+
+	if (!MoveFileExA(tempPath.c_str(), shader.spirvPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		printf("Failed to replace %s\n", shader.spirvPath.c_str());
+		DeleteFileA(tempPath.c_str());
+		return false;
+	}
+
+	printf("Recompiled %s\n", shader.sourcePath.c_str());
+	return true;
+}
+
+uint64_t ShaderWatcher::GetLastWriteTime(const char* path)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attributes))
+		return 0;
+
+	return (static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+}
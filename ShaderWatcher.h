@@ -0,0 +1,56 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Polls GLSL sources on its own thread and recompiles the ones that changed with glslc from the
+// Vulkan SDK. The callback runs on the watcher thread too, so nothing it does can stall a frame.
+class ShaderWatcher
+{
+public:
+	// Receives the SPIR-V paths of every shader that compiled in one poll.
+	using CompiledCallback = std::function<void(const std::vector<std::string>&)>;
+
+	ShaderWatcher() = default;
+	~ShaderWatcher();
+
+	ShaderWatcher(const ShaderWatcher&) = delete;
+	ShaderWatcher& operator=(const ShaderWatcher&) = delete;
+
+	// Only takes effect for watchers started afterwards.
+	void Watch(const char* sourcePath, const char* spirvPath);
+	// Returns false when the compiler can't be found.
+	bool Start(CompiledCallback onCompiled);
+	void Stop();
+
+	bool IsRunning() const { return mThread.joinable(); }
+
+private:
+	struct WatchedShader
+	{
+		std::string sourcePath;
+		std::string spirvPath;
+		uint64_t lastWriteTime;
+	};
+
+	void WatcherMain();
+	// Compiles to a temporary file first so a shader with errors never replaces the working SPIR-V.
+	bool Compile(const WatchedShader& shader) const;
+	static uint64_t GetLastWriteTime(const char* path);
+
+	static constexpr uint32_t pollIntervalMs = 250;
+
+	std::vector<WatchedShader> mShaders;
+	std::string mCompilerPath;
+	CompiledCallback mOnCompiled;
+
+	std::thread mThread;
+	std::mutex mMutex;
+	std::condition_variable mQuitCondition;
+	bool mQuit = false;
+};
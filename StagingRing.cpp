@@ -0,0 +1,109 @@
+#include "StagingRing.h"
+
+#include "MemoryAllocator.h"
+
+#include <cassert>
+
+void StagingRing::Init(MemoryAllocator* allocator, const Buffer& buffer, VkDeviceSize capacity)
+{
+	assert(capacity <= buffer.size && "Staging ring is bigger than its buffer.");
+
+	mAllocator = allocator;
+	mBuffer = buffer;
+	mCapacity = capacity;
+	mHead = 0;
+	mTail = 0;
+	mUsed = 0;
+	mPendingBytes = 0;
+	mRegions.clear();
+	mMapped = static_cast<char*>(mAllocator->Map(mBuffer.allocation));
+}
+
+void StagingRing::Release()
+{
+	if (mMapped)
+	{
+		mAllocator->Unmap(mBuffer.allocation);
+		mMapped = nullptr;
+	}
+}
+
+bool StagingRing::Allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& out_offset, void*& out_mapped)
+{
+	if (size > mCapacity)
+		return false;
+
+	if (mUsed == 0)
+	{
+		// Nothing in flight, start over from the beginning to get the biggest contiguous range.
+		mHead = 0;
+		mTail = 0;
+	}
+	else if (mHead == mTail)
+	{
+		// Head caught up with the tail, the ring is full.
+		return false;
+	}
+
+	VkDeviceSize offset = (mHead + alignment - 1) & ~(alignment - 1);
+	VkDeviceSize taken = 0;
+
+	if (mHead >= mTail)
+	{
+		// Free space is [head, capacity) and [0, tail).
+		if (offset + size <= mCapacity)
+		{
+			taken = offset + size - mHead;
+		}
+		else if (size <= mTail)
+		{
+			taken = (mCapacity - mHead) + size;
+			offset = 0;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	else
+	{
+		// Free space is [head, tail).
+		if (offset + size > mTail)
+			return false;
+		taken = offset + size - mHead;
+	}
+
+	mHead = offset + size;
+	if (mHead == mCapacity)
+		mHead = 0;
+	mUsed += taken;
+	mPendingBytes += taken;
+
+	out_offset = offset;
+	out_mapped = mMapped + offset;
+	return true;
+}
+
+void StagingRing::Submit(uint64_t submitId)
+{
+	if (mPendingBytes == 0)
+		return;
+
+	Region region;
+	region.submitId = submitId;
+	region.end = mHead;
+	region.size = mPendingBytes;
+	mRegions.push_back(region);
+
+	mPendingBytes = 0;
+}
+
+void StagingRing::Retire(uint64_t submitId)
+{
+	while (!mRegions.empty() && mRegions.front().submitId <= submitId)
+	{
+		mTail = mRegions.front().end;
+		mUsed -= mRegions.front().size;
+		mRegions.pop_front();
+	}
+}
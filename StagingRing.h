@@ -0,0 +1,51 @@
+#pragma once
+
+#include "HelperStructs.h"
+#include <deque>
+
+class MemoryAllocator;
+
+// A host visible buffer that stays mapped and is used as a circular staging area for uploads.
+// Allocations made between two Submit calls form one region that is tagged with the submission
+// id, once the GPU is done with that submission Retire gives the space back to the ring.
+class StagingRing
+{
+public:
+	StagingRing() = default;
+
+	void Init(MemoryAllocator* allocator, const Buffer& buffer, VkDeviceSize capacity);
+	void Release();
+
+	// Returns false when there is no room left until older submissions are retired.
+	bool Allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& out_offset, void*& out_mapped);
+	// Everything allocated since the previous call belongs to this submission.
+	void Submit(uint64_t submitId);
+	// All submissions up to and including submitId have finished on the GPU.
+	void Retire(uint64_t submitId);
+
+	const Buffer& GetBuffer() const { return mBuffer; }
+	VkDeviceSize GetCapacity() const { return mCapacity; }
+	VkDeviceSize GetUsedBytes() const { return mUsed; }
+	bool HasUnsubmittedAllocations() const { return mPendingBytes > 0; }
+
+private:
+	struct Region
+	{
+		uint64_t submitId;
+		// Where the ring head was when the region was submitted, the tail moves here on retire.
+		VkDeviceSize end;
+		// Bytes taken by the region, including the bytes skipped when wrapping around.
+		VkDeviceSize size;
+	};
+
+	MemoryAllocator* mAllocator = nullptr;
+	Buffer mBuffer{};
+	char* mMapped = nullptr;
+	VkDeviceSize mCapacity = 0;
+
+	VkDeviceSize mHead = 0;
+	VkDeviceSize mTail = 0;
+	VkDeviceSize mUsed = 0;
+	VkDeviceSize mPendingBytes = 0;
+	std::deque<Region> mRegions;
+};
@@ -0,0 +1,92 @@
+#include "ThreadPool.h"
+
+#include <cassert>
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+{
+	for (uint32_t i = 0; i < threadCount; i++)
+		mThreads.emplace_back(&ThreadPool::WorkerMain, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mWakeCondition.notify_all();
+
+	for (std::thread& thread : mThreads)
+		thread.join();
+}
+
+void ThreadPool::Run(uint32_t workerCount, const std::function<void(uint32_t)>& job)
+{
+	assert(workerCount <= mThreads.size());
+	if (workerCount == 0)
+		return;
+
+	// Handing a single job to a worker would only add a wake up, run it here instead.
+	if (workerCount == 1)
+	{
+		job(0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJob = &job;
+		mActiveWorkers = workerCount;
+		mPendingWorkers = workerCount;
+		mError = nullptr;
+		mGeneration++;
+	}
+	mWakeCondition.notify_all();
+
+	std::exception_ptr error;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mDoneCondition.wait(lock, [this] { return mPendingWorkers == 0; });
+		mJob = nullptr;
+		error = mError;
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void ThreadPool::WorkerMain(uint32_t workerIndex)
+{
+	uint64_t seenGeneration = 0;
+	for (;;)
+	{
+		const std::function<void(uint32_t)>* job = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mWakeCondition.wait(lock, [&] { return mQuit || mGeneration != seenGeneration; });
+			if (mQuit)
+				return;
+
+			seenGeneration = mGeneration;
+			if (workerIndex >= mActiveWorkers)
+				continue;
+			job = mJob;
+		}
+
+		std::exception_ptr error;
+		try
+		{
+			(*job)(workerIndex);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (error && !mError)
+			mError = error;
+		if (--mPendingWorkers == 0)
+			mDoneCondition.notify_one();
+	}
+}
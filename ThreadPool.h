@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run one parallel job at a time. The thread calling Run
+// blocks until every worker taking part is done, so the job can safely reference its stack.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(uint32_t threadCount);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Calls job(workerIndex) once for every index below workerCount and waits for all of them.
+	// An exception thrown by the job is rethrown here once all the workers have finished.
+	void Run(uint32_t workerCount, const std::function<void(uint32_t)>& job);
+
+	uint32_t GetThreadCount() const { return static_cast<uint32_t>(mThreads.size()); }
+
+private:
+	void WorkerMain(uint32_t workerIndex);
+
+	std::vector<std::thread> mThreads;
+
+	std::mutex mMutex;
+	std::condition_variable mWakeCondition;
+	std::condition_variable mDoneCondition;
+	const std::function<void(uint32_t)>* mJob = nullptr;
+	// Bumped by every Run so the workers can tell a new job from a spurious wake up.
+	uint64_t mGeneration = 0;
+	uint32_t mActiveWorkers = 0;
+	uint32_t mPendingWorkers = 0;
+	std::exception_ptr mError;
+	bool mQuit = false;
+};
@@ -0,0 +1,55 @@
+#include "UniformRing.h"
+
+#include "MemoryAllocator.h"
+
+#include <cassert>
+#include <cstring>
+
+void UniformRing::Init(MemoryAllocator* allocator, const Buffer& buffer, VkDeviceSize frameSize, uint32_t frameCount)
+{
+	assert(frameSize * frameCount <= buffer.size && "Uniform ring doesn't fit in the buffer.");
+
+	mAllocator = allocator;
+	mBuffer = buffer;
+	mFrameSize = CalculateUniformBufferSize(frameSize);
+	mFrameCount = frameCount;
+	mFrameIndex = 0;
+	mHead = 0;
+	mMapped = static_cast<char*>(mAllocator->Map(mBuffer.allocation));
+}
+
+void UniformRing::Release()
+{
+	if (mMapped)
+	{
+		mAllocator->Unmap(mBuffer.allocation);
+		mMapped = nullptr;
+	}
+}
+
+void UniformRing::BeginFrame(uint32_t frameIndex)
+{
+	assert(frameIndex < mFrameCount);
+
+	mFrameIndex = frameIndex;
+	mHead = GetFrameOffset(frameIndex);
+}
+
+VkDeviceSize UniformRing::Push(const void* data, VkDeviceSize size)
+{
+	VkDeviceSize offset = 0;
+	memcpy(Allocate(size, offset), data, static_cast<size_t>(size));
+
+	return offset;
+}
+
+void* UniformRing::Allocate(VkDeviceSize size, VkDeviceSize& out_offset)
+{
+	VkDeviceSize slotSize = CalculateUniformBufferSize(size);
+	assert(mHead + slotSize <= GetFrameOffset(mFrameIndex) + mFrameSize && "Uniform ring frame slice overflow.");
+
+	out_offset = mHead;
+	mHead += slotSize;
+
+	return mMapped + out_offset;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "HelperStructs.h"
+
+class MemoryAllocator;
+
+// A uniform or storage buffer split in one slice per frame, mapped once for its whole lifetime.
+// Every frame the slice of that frame is rewound and the data is bump allocated
+// from it in 256 byte steps. Reusing a slice is only safe once the frame that last read it
+// has finished on the GPU, so BeginFrame must come after waiting for it.
+class UniformRing
+{
+public:
+	UniformRing() = default;
+
+	void Init(MemoryAllocator* allocator, const Buffer& buffer, VkDeviceSize frameSize, uint32_t frameCount);
+	void Release();
+
+	void BeginFrame(uint32_t frameIndex);
+	// Copies the data into the next slot of the current frame and returns its offset from the start of the buffer.
+	VkDeviceSize Push(const void* data, VkDeviceSize size);
+	// Reserves the next slot of the current frame so the caller can write into it directly.
+	void* Allocate(VkDeviceSize size, VkDeviceSize& out_offset);
+
+	const Buffer& GetBuffer() const { return mBuffer; }
+	VkDeviceSize GetFrameOffset(uint32_t frameIndex) const { return frameIndex * mFrameSize; }
+	VkDeviceSize GetFrameSize() const { return mFrameSize; }
+	// Mapped start of a frame slice, for reading back what the GPU wrote once that frame has finished.
+	void* GetFrameData(uint32_t frameIndex) const { return mMapped + GetFrameOffset(frameIndex); }
+	// Bytes pushed into the current frame so far.
+	VkDeviceSize GetFrameUsage() const { return mHead - GetFrameOffset(mFrameIndex); }
+
+private:
+	MemoryAllocator* mAllocator = nullptr;
+	Buffer mBuffer{};
+	char* mMapped = nullptr;
+	VkDeviceSize mFrameSize = 0;
+	uint32_t mFrameCount = 0;
+
+	uint32_t mFrameIndex = 0;
+	VkDeviceSize mHead = 0;
+};
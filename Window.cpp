@@ -119,12 +119,16 @@ LRESULT __stdcall Window::MainWndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM
 		}
 		else if (wParam == SIZE_MAXIMIZED)
 		{
-			//mRenderer->NotifyWindowResize(mWidth, mHeight);
+			if (mRenderer)
+				mRenderer->NotifyWindowResize(mWidth, mHeight);
 			mCanRender = true;
 		}
 		else if (wParam == SIZE_RESTORED)
 		{
-			//mRenderer->NotifyWindowResize(mWidth, mHeight);
+			// Recreating the swapchain doesn't stall anymore, so this also runs while dragging the edges.
+			// ShowWindow sends the first WM_SIZE before the renderer exists.
+			if (mRenderer)
+				mRenderer->NotifyWindowResize(mWidth, mHeight);
 			mCanRender = true;
 		}
 		//if (md3dDevice)
@@ -2,11 +2,14 @@
 #extension GL_EXT_debug_printf : enable
 #extension GL_EXT_spirv_intrinsics : enable
 
+// Set through VkSpecializationInfo for the line fill variant, lines stay opaque so blending doesn't wash them out.
+layout(constant_id = 1) const bool WIREFRAME = false;
+
 layout(location = 0) in vec4 inColor;
 layout(location = 0) out vec4 outColor;
 
 void main()
 {
-	outColor = inColor;
+	outColor = WIREFRAME ? vec4(inColor.rgb, 1.0) : inColor;
 	//debugPrintfEXT("frag: %f %f %f %f\n", inColor.x, inColor.y, inColor.z, inColor.z);
 }
\ No newline at end of file
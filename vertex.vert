@@ -3,6 +3,11 @@
 #extension GL_EXT_debug_printf : enable
 #extension GL_EXT_spirv_intrinsics : enable
 
+// Set per pipeline through VkSpecializationInfo. The driver folds the branches when it builds the pipeline, but they
+// stay in the SPIR-V, so every variant statically uses sets 0 to 2 and the push constant and needs all of them bound.
+// Where the transform comes from, same values as ObjectDataPath: 0 storage buffer, 1 dynamic uniform, 2 push constant.
+layout(constant_id = 0) const int OBJECT_DATA_SOURCE = 0;
+
 layout(set = 0, binding = 0) uniform GlobalUniform 
 {
 	mat4 view;
@@ -25,6 +30,20 @@ layout(set = 1, binding = 0) uniform PerObjectUniform
 	mat4 model;
 } perObject;
 
+// One transform per instance, gl_InstanceIndex already includes the firstInstance of the draw.
+layout(std430, set = 2, binding = 0) readonly buffer InstanceBuffer
+{
+	mat4 model[];
+} instances;
+
+// The CPU multiplies model, view and projection once per draw and pushes the result.
+layout(push_constant) uniform ObjectPushConstants
+{
+	mat4 modelViewProj;
+} pushConstants;
+
+// Only the position and color are read, they reach the shader as floats with either VertexLayout. With PackedVertex
+// the normal and tangent hold octahedral pairs in xy, whatever starts reading them has to decode those first.
 layout(location = 0) in vec3 inPos;
 layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec3 inTangentU;
@@ -35,9 +54,14 @@ layout(location = 0) out vec4 outColor;
 
 void main()
 {
-	gl_Position = globalUniform.projection * globalUniform.view * perObject.model * vec4(inPos.xyz, 1.0);
-	//debugPrintfEXT("inPos %f %f %f\n", inPos.x, inPos.y, inPos.z);
-	//debugPrintfEXT("inColor %f %f %f %f\n", inColor.x, inColor.y, inColor.z, inColor.w);
-	//debugPrintfEXT("projection %f %f %f %f\n", globalUniform.projection[0], globalUniform.projection[1], globalUniform.projection[2], globalUniform.projection[3]);
+	vec4 position = vec4(inPos.xyz, 1.0);
+
+	if (OBJECT_DATA_SOURCE == 2)
+		gl_Position = pushConstants.modelViewProj * position;
+	else if (OBJECT_DATA_SOURCE == 1)
+		gl_Position = globalUniform.projection * globalUniform.view * perObject.model * position;
+	else
+		gl_Position = globalUniform.projection * globalUniform.view * instances.model[gl_InstanceIndex] * position;
+
 	outColor = inColor;
 }
\ No newline at end of file